@@ -0,0 +1,93 @@
+#ifndef AUTH_INDEX_H
+#define AUTH_INDEX_H
+
+#include <Arduino.h>
+#include <sqlite3.h>
+
+// Upper limit for the amount of RAM used by the in-RAM index; if the
+// authorized hashes for this door do not fit, we query SQLite instead.
+#ifndef AUTH_INDEX_MAX_BYTES
+#define AUTH_INDEX_MAX_BYTES 65536
+#endif
+
+// Upper limit for the amount of RAM used by the prefix index, which we
+// use when the full in-RAM index does not fit (8 bytes per authorized
+// user; 200k users need 1.6MB, so in practice this requires PSRAM).
+#ifndef AUTH_PREFIX_INDEX_MAX_BYTES
+#define AUTH_PREFIX_INDEX_MAX_BYTES 2097152
+#endif
+
+// Upper limit for the amount of RAM used by the Bloom filter, which
+// we use when the in-RAM index does not fit, and the false positive
+// rate we aim for (we may not reach it if the filter would be too big)
+#ifndef AUTH_BLOOM_MAX_BYTES
+#define AUTH_BLOOM_MAX_BYTES 32768
+#endif
+
+#ifndef AUTH_BLOOM_FP_RATE
+#define AUTH_BLOOM_FP_RATE 0.01
+#endif
+
+#define HASH_SIZE 32 // SHA-256
+
+// Maximum length of the SQL query that lists the users authorized for
+// this door (it embeds the IDs of the door groups this door belongs to)
+#ifndef AUTH_QUERY_SIZE
+#define AUTH_QUERY_SIZE 512
+#endif
+
+// Converts a (lowercase) 64-char hexadecimal hash to its binary form
+bool hashFromHex(const char* hex, uint8_t* binHash);
+
+// Reads a hash from a TEXT (schema v1) or BLOB (schema v2) column
+bool hashFromColumn(sqlite3_stmt* query, int col, uint8_t* binHash);
+
+// A sorted array with all the hashes authorized for a given door, built
+// from the SQLite DB. This allows us to answer most queries with a
+// binary search in RAM instead of reading the DB from disk. If the DB
+// has schedules, each hash is followed by the user's schedule ID.
+class AuthIndex {
+    public:
+        bool build(sqlite3* db, const char* usersQuery, bool withSchedules);
+        void clear();
+        inline bool available() { return hashes != NULL; };
+        bool contains(const uint8_t* binHash, uint16_t& scheduleID);
+    private:
+        uint8_t* hashes = NULL;
+        size_t count = 0;
+        size_t recordSize = HASH_SIZE;
+};
+
+// Same as AuthIndex, but keeping only the first 64 bits of each hash.
+// If a hash is not there, the user is not authorized; if it is, the
+// user is almost certainly authorized, but we still confirm with SQLite
+// (so a denied card almost never touches the disk and an authorized
+// card touches it exactly once).
+class PrefixIndex {
+    public:
+        bool build(sqlite3* db, const char* usersQuery);
+        void clear();
+        inline bool available() { return prefixes != NULL; };
+        bool mightContain(const uint8_t* binHash);
+    private:
+        uint64_t* prefixes = NULL;
+        size_t count = 0;
+};
+
+// A Bloom filter with all the hashes authorized for a given door. If
+// it says a hash is not there, it really is not, so we can deny access
+// without querying SQLite (most denied cards are not even in the DB).
+class BloomFilter {
+    public:
+        bool build(sqlite3* db, const char* usersQuery);
+        void clear();
+        inline bool available() { return bits != NULL; };
+        bool mightContain(const uint8_t* binHash);
+    private:
+        inline void add(const uint8_t* binHash);
+        uint8_t* bits = NULL;
+        uint32_t numBits = 0;
+        uint8_t numHashes = 0;
+};
+
+#endif
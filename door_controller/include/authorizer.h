@@ -1,10 +1,42 @@
 #ifndef AUTHORIZER_H
 #define AUTHORIZER_H
 
-int openDB(const char*);
+#include <Arduino.h>
+
+// With DB_SHARDS > 1, the DB is split in this many files (shards) by the
+// first byte of the hash (check dbShard()), each one downloaded and opened
+// on its own; this must be a power of 2 and the server must use the same
+// value (check poc_manager/dbshards.py)
+#ifndef DB_SHARDS
+#define DB_SHARDS 1
+#endif
+
+#if DB_SHARDS > 32
+#error "DB_SHARDS must be at most 32"
+#endif
+
+inline int dbShard(const byte* binHash) {
+    return binHash[0] * DB_SHARDS / 256;
+}
+
+int openDB(const char*, int shard = 0);
 void closeDB();
-bool userAuthorized(const char* readerID, const char* cardHash);
+void closeDB(int shard);
+void openFlatIndex();
+void closeFlatIndex();
+void setDBShardsVersion(unsigned int version); // with DB_SHARDS > 1
+void loadAuthSnapshot();
+bool userAuthorized(const char* readerID, const byte* binHash,
+                    const char* cardHash);
+bool cardAuthorized(const char* readerID, unsigned long cardID, char* hashBuf);
 void refreshQuery();
-void calculate_hash(unsigned long cardID, char* hashBuf);
+void calculate_hash(unsigned long cardID, byte* binHash);
+void hashToHex(const byte* binHash, char* hashBuf);
+void logAuthStats();
+void benchmarkHash();
+void benchmarkDB();
+void benchmarkDBCache();
+unsigned int currentDBVersion();
+void aliasDBVersion(unsigned int fileVersion, unsigned int version);
 
 #endif
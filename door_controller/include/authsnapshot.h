@@ -0,0 +1,50 @@
+#ifndef AUTH_SNAPSHOT_H
+#define AUTH_SNAPSHOT_H
+
+#include <Arduino.h>
+#include <sqlite3.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Upper limit for the number of users in the snapshot (8 bytes each, in
+// flash and, while there is no DB, in RAM); with more users than this
+// (or than fit in half of the partition) for this door, we do not keep
+// one.
+#ifndef AUTH_SNAPSHOT_MAX_USERS
+#define AUTH_SNAPSHOT_MAX_USERS 4000
+#endif
+
+#define AUTH_SNAPSHOT_PARTITION "authsnap"
+#define AUTH_SNAPSHOT_MAGIC "TRAMSNP1"
+
+// Each half ("slot") of the partition may hold a snapshot: this header
+// followed by "count" uint64_t prefixes (the first 8 bytes of each
+// hash), sorted. The valid one with the highest sequence is current.
+typedef struct {
+    char magic[8];  // AUTH_SNAPSHOT_MAGIC, not NULL-terminated
+    uint32_t doorID;
+    uint32_t count;
+    uint32_t crc;   // CRC32 of the prefixes
+    uint32_t sequence;
+} AuthSnapshotHeader;
+
+// The users authorized for this door without restrictions, saved when
+// a DB is activated and used when there is no DB (check authsnapshot.cpp)
+class AuthSnapshot {
+    public:
+        void save(sqlite3* db, const char* usersQuery, bool withSchedules);
+        bool load();
+        void clear();
+        bool contains(const uint8_t* binHash);
+    private:
+        uint64_t* prefixes = NULL;
+        size_t count = 0;
+        SemaphoreHandle_t lock = NULL;
+
+        bool read(AuthSnapshotHeader& header, uint64_t*& data, int& slot);
+        bool write(int slot, AuthSnapshotHeader& header,
+                   const uint64_t* data);
+        void erase();
+};
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef CARD_HASH_H
+#define CARD_HASH_H
+
+#include <stdint.h>
+
+// The SHA-256 of a card ID, as stored in the DB (check cardhash.cpp)
+void cardHash(unsigned long cardID, uint8_t* binHash);
+
+// Lowercase hexadecimal, NULL-terminated (65 chars)
+void cardHashToHex(const uint8_t* binHash, char* hashBuf);
+
+#endif
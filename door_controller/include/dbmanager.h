@@ -5,6 +5,19 @@ void initDBMan();
 ssize_t writeToDatabaseFile(const char* data, int data_len);
 void finishDBDownload();
 void cancelDBDownload();
+ssize_t writeToDBDelta(const char* data, int data_len);
+void finishDBDelta();
+void cancelDBDelta();
+ssize_t writeToDBChunk(const char* data, int data_len);
+bool finishDBChunk(); // false if we need another chunk
+void cancelDBChunk();
+unsigned int nextDBChunk();
+bool checkDBManifest(const char* data, int data_len); // true if up to date
+void selectDBShard(int shard); // with DB_SHARDS > 1, before downloading it
+uint32_t checkDBShardManifest(const char* data, int data_len); // stale ones
 bool wipeDBFiles();
+ssize_t writeToFlatIndex(const char* data, int data_len);
+void finishFlatIndexDownload();
+void cancelFlatIndexDownload();
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef FLAT_INDEX_H
+#define FLAT_INDEX_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#define FLAT_INDEX_PARTITION "authidx"
+#define FLAT_INDEX_MAGIC "TRAMIDX1" // sorted array of hashes
+#define MPH_INDEX_MAGIC "TRAMMPH1"  // perfect hash table of fingerprints
+
+#define MPH_FINGERPRINT_SIZE 8
+
+// The flat index is generated by the server (check poc_manager/authindex.py)
+// and is simply this header followed by the "body". All integers are
+// little-endian. There are two formats:
+//
+// * FLAT_INDEX_MAGIC: the body is "count" records, each one being the
+//   binary hash of a user authorized to open this door, sorted.
+//
+// * MPH_INDEX_MAGIC: the body is a perfect hash table (check
+//   flatindex.cpp), with MPH_FINGERPRINT_SIZE bytes per record.
+typedef struct {
+    char magic[8];       // one of the above, not NULL-terminated
+    uint32_t doorID;
+    uint32_t count;      // number of authorized users
+    uint32_t recordSize; // HASH_SIZE or MPH_FINGERPRINT_SIZE
+    uint32_t dbVersion;  // "PRAGMA user_version" of the originating DB
+    uint32_t crc;        // CRC32 of the body
+    uint32_t bodySize;   // size of everything after the header
+} FlatIndexHeader;
+
+// Header of the body for the MPH_INDEX_MAGIC format, followed by
+// "numBuckets" uint16_t pilots (padded to a multiple of 4 bytes) and
+// "numSlots" fingerprints.
+typedef struct {
+    uint32_t numSlots;
+    uint32_t numBuckets;
+} MPHIndexHeader;
+
+// Reads the flat index directly from the flash partition, through the
+// flash cache (esp_partition_mmap), without FAT, VFS or SQLite.
+class FlatIndex {
+    public:
+        bool open();
+        void close();
+        inline bool available() { return body != NULL; };
+        // false if the index is not available; if it is, "found" tells
+        // whether the hash is there
+        bool lookup(const uint8_t* binHash, bool& found);
+        inline uint32_t version() { return header.dbVersion; };
+    private:
+        FlatIndexHeader header;
+        const uint8_t* volatile body = NULL;
+        spi_flash_mmap_handle_t mmapHandle;
+        SemaphoreHandle_t lock = NULL; // held while "body" is in use
+
+        bool perfectHash;
+        MPHIndexHeader mphHeader;
+        const uint16_t* pilots;
+        const uint8_t* fingerprints;
+
+        bool sortedContains(const uint8_t* data, const uint8_t* binHash);
+        bool perfectHashContains(const uint8_t* binHash);
+};
+
+bool flatIndexHeaderIsValid(const FlatIndexHeader* header,
+                            size_t partitionSize);
+
+#endif
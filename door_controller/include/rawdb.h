@@ -0,0 +1,31 @@
+#ifndef RAW_DB_H
+#define RAW_DB_H
+
+#include <Arduino.h>
+#include <sqlite3.h>
+
+// With DB_RAW_PARTITION defined, the Authorizer copies each DB it opens
+// to one of the two halves ("slots") of this partition and opens it from
+// there, read-only, through the RAW_DB_VFS SQLite VFS (check rawdb.cpp).
+// The partition is in rawdb_ffat.csv, in place of the flat index one
+// (build with "pio run -e rawdb"); with more flash, it may be larger.
+#define RAW_DB_PARTITION "authdb"
+#define RAW_DB_MAGIC "TRAMRDB1"
+#define RAW_DB_VFS "rawflash"
+
+// The first sector of each slot; the DB file follows it
+typedef struct {
+    char magic[8];   // RAW_DB_MAGIC, not NULL-terminated
+    uint32_t size;   // of the DB file
+    uint32_t crc;    // CRC32 of the DB file
+} RawDBHeader;
+
+// Copies the DB file (e.g. "/DB_A.db") to the given slot (0 or 1),
+// rewriting only the flash sectors that differ
+bool copyToRawSlot(const char* filename, int slot);
+
+// Opens the DB in the given slot, read-only; as with sqlite3_open(),
+// "db" should be closed even if this fails
+int openRawSlot(int slot, sqlite3** db);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SCHEDULES_H
+#define SCHEDULES_H
+
+#include <Arduino.h>
+#include <sqlite3.h>
+
+// Maximum number of distinct schedules in the DB; each one takes
+// SCHEDULE_MASK_BYTES bytes of RAM.
+#ifndef MAX_SCHEDULES
+#define MAX_SCHEDULES 64
+#endif
+
+#define SCHEDULE_SLOT_MINUTES 15
+#define SCHEDULE_SLOTS_PER_DAY (24 * 60 / SCHEDULE_SLOT_MINUTES)
+#define SCHEDULE_MASK_BYTES (7 * SCHEDULE_SLOTS_PER_DAY / 8)
+
+// Schedule ID meaning "no restrictions" (also used for NULL)
+#define NO_SCHEDULE 0
+
+// Not a real schedule: used by AuthIndex when a user is listed more
+// than once for the same door, with different schedules
+#define MIXED_SCHEDULES UINT16_MAX
+
+// Reads a schedule ID ("auth.schedule") from a query; NULL means
+// NO_SCHEDULE. Returns false if the value cannot be a schedule ID (not
+// an integer, negative, MIXED_SCHEDULES or more), in which case the
+// user must be denied access.
+bool scheduleFromColumn(sqlite3_stmt* query, int col, uint16_t& scheduleID);
+
+// The "schedules" table from the DB, compiled into one bitmask per
+// schedule with one bit per quarter hour of the week, so checking
+// whether a user may enter now is a single bit test.
+class ScheduleTable {
+    public:
+        bool build(sqlite3* db);
+        void clear();
+        inline bool available() { return count > 0; };
+        bool allows(uint16_t scheduleID, unsigned long now);
+    private:
+        typedef struct {
+            uint16_t ID;
+            uint8_t mask[SCHEDULE_MASK_BYTES];
+        } Schedule;
+
+        Schedule* schedules = NULL;
+        size_t count = 0;
+        Schedule* find(uint16_t scheduleID);
+};
+
+#endif
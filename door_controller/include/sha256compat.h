@@ -0,0 +1,49 @@
+#ifndef SHA256_COMPAT_H
+#define SHA256_COMPAT_H
+
+#include <mbedtls/version.h>
+#include <mbedtls/sha256.h>
+
+// mbedtls 2 (ESP-IDF 4) has the SHA-256 functions that return an error
+// code with a "_ret" suffix and deprecated void versions without it;
+// mbedtls 3 (ESP-IDF 5) only has the latter, which now return the error
+// code. These wrappers call the right ones in either case.
+#if MBEDTLS_VERSION_MAJOR < 3
+inline int sha256(const unsigned char* data, size_t len,
+                  unsigned char* digest) {
+    return mbedtls_sha256_ret(data, len, digest, 0);
+}
+
+inline int sha256Starts(mbedtls_sha256_context* ctx) {
+    return mbedtls_sha256_starts_ret(ctx, 0);
+}
+
+inline int sha256Update(mbedtls_sha256_context* ctx,
+                        const unsigned char* data, size_t len) {
+    return mbedtls_sha256_update_ret(ctx, data, len);
+}
+
+inline int sha256Finish(mbedtls_sha256_context* ctx, unsigned char* digest) {
+    return mbedtls_sha256_finish_ret(ctx, digest);
+}
+#else
+inline int sha256(const unsigned char* data, size_t len,
+                  unsigned char* digest) {
+    return mbedtls_sha256(data, len, digest, 0);
+}
+
+inline int sha256Starts(mbedtls_sha256_context* ctx) {
+    return mbedtls_sha256_starts(ctx, 0);
+}
+
+inline int sha256Update(mbedtls_sha256_context* ctx,
+                        const unsigned char* data, size_t len) {
+    return mbedtls_sha256_update(ctx, data, len);
+}
+
+inline int sha256Finish(mbedtls_sha256_context* ctx, unsigned char* digest) {
+    return mbedtls_sha256_finish(ctx, digest);
+}
+#endif
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SQLITE_MEM_H
+#define SQLITE_MEM_H
+
+// Memory reserved for SQLite (check sqlitemem.cpp); SQLITE_ARENA_SIZE = 0
+// makes SQLite use the general heap, as it did before
+#ifndef SQLITE_ARENA_SIZE
+#define SQLITE_ARENA_SIZE 65536
+#endif
+
+// Page cache pool: SQLITE_PAGECACHE_PAGES pages of SQLITE_PAGE_SIZE bytes
+// (the page size of the DBs the server sends; larger pages do not use it)
+#ifndef SQLITE_PAGECACHE_PAGES
+#define SQLITE_PAGECACHE_PAGES 8
+#endif
+
+#ifndef SQLITE_PAGE_SIZE
+#define SQLITE_PAGE_SIZE 4096
+#endif
+
+// Smallest allocation in the arena (a power of 2)
+#ifndef SQLITE_ARENA_MIN_ALLOC
+#define SQLITE_ARENA_MIN_ALLOC 32
+#endif
+
+void initSQLite(); // Instead of sqlite3_initialize()
+void logSQLiteMemory();
+
+#endif
@@ -0,0 +1,437 @@
+static const char *TAG = "authidx";
+
+#include <tramela.h>
+#include <Arduino.h>
+#include <sqlite3.h>
+#include <authindex.h>
+#include <schedules.h> // NO_SCHEDULE, MIXED_SCHEDULES, scheduleFromColumn()
+#include <math.h>
+
+/*
+  With many users, each query to SQLite may need to read a few pages
+  from the disk, which is slow and, worse, unpredictable. So, when a
+  DB is activated, we read all the hashes authorized for this door
+  into a sorted array and answer queries with a binary search. This
+  takes 32 bytes per authorized user, so we only do it if the array
+  fits in AUTH_INDEX_MAX_BYTES (and in the available heap); otherwise,
+  the Authorizer keeps querying SQLite as usual.
+
+  If the index does not fit, we try to keep only a 64-bit prefix of each
+  hash (up to AUTH_PREFIX_INDEX_MAX_BYTES); this needs a quarter of the
+  memory and tells us for sure that a card is not authorized, but a
+  match needs to be confirmed with SQLite. With 64 bits, the chance
+  that an unknown card matches some prefix is about count / 2^64.
+
+  If even that does not fit, we build a Bloom filter instead: this
+  tells us, without reading the disk, that most unknown cards (transit
+  passes, badges from other buildings etc.) are not authorized. Its
+  size is chosen when the DB is activated, according to the number of
+  authorized users, AUTH_BLOOM_FP_RATE and AUTH_BLOOM_MAX_BYTES.
+
+  With schema v1, we only accept lowercase hexadecimal hashes: those are
+  the only ones that may ever match a hash calculated by the Authorizer,
+  so any other row in the DB can be safely ignored (SQLite compares
+  strings case-sensitively, so these rows would never match there
+  either).
+*/
+
+inline int hexDigit(char c) {
+    if (c >= '0' and c <= '9') { return c - '0'; }
+    if (c >= 'a' and c <= 'f') { return c - 'a' + 10; }
+    return -1;
+}
+
+bool hashFromHex(const char* hex, uint8_t* binHash) {
+    for (int i = 0; i < HASH_SIZE; ++i) {
+        int high = hexDigit(hex[2*i]);
+        if (high < 0) { return false; } // also catches a premature '\0'
+        int low = hexDigit(hex[2*i +1]);
+        if (low < 0) { return false; }
+        binHash[i] = (high << 4) | low;
+    }
+
+    return hex[2 * HASH_SIZE] == 0;
+}
+
+// Schema v1 stores the hashes as hexadecimal TEXT, schema v2 as BLOBs
+bool hashFromColumn(sqlite3_stmt* query, int col, uint8_t* binHash) {
+    if (sqlite3_column_type(query, col) == SQLITE_BLOB) {
+        if (sqlite3_column_bytes(query, col) != HASH_SIZE) { return false; }
+        memcpy(binHash, sqlite3_column_blob(query, col), HASH_SIZE);
+        return true;
+    }
+
+    const char* hex = (const char*) sqlite3_column_text(query, col);
+    return hex != NULL and hashFromHex(hex, binHash);
+}
+
+int compareHashes(const void* a, const void* b) {
+    return memcmp(a, b, HASH_SIZE);
+}
+
+// "usersQuery" lists the users authorized for this door (check
+// Authorizer::buildQueries()): the first column is the hash and the
+// second, if the DB has schedules, is the schedule ID.
+bool countAuthorized(sqlite3* db, const char* usersQuery, size_t& rows) {
+    char sql[AUTH_QUERY_SIZE + 32];
+    snprintf(sql, sizeof(sql), "SELECT count(*) FROM (%s)", usersQuery);
+
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &query, NULL);
+    if (rc != SQLITE_OK) {
+        log_w("Cannot count authorized users: %s", sqlite3_errmsg(db));
+        return false;
+    }
+
+    rows = 0;
+    rc = sqlite3_step(query);
+    if (rc == SQLITE_ROW) {
+        rows = sqlite3_column_int(query, 0);
+    }
+    sqlite3_finalize(query);
+
+    return rc == SQLITE_ROW;
+}
+
+bool AuthIndex::build(sqlite3* db, const char* usersQuery,
+                      bool withSchedules) {
+    clear();
+
+    unsigned long start = millis();
+    sqlite3_stmt* query;
+
+    size_t rows;
+    if (not countAuthorized(db, usersQuery, rows)) { return false; }
+
+    recordSize = HASH_SIZE + (withSchedules ? sizeof(uint16_t) : 0);
+    size_t bytes = rows * recordSize;
+    if (bytes > AUTH_INDEX_MAX_BYTES) {
+        log_i("Too many authorized users (%u) for the in-RAM index, "
+              "using SQLite directly", rows);
+        return false;
+    }
+
+    // Do not use up all the available memory, other things need it too
+    if (bytes > heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 2) {
+        log_w("Not enough memory for the in-RAM index (%u bytes), "
+              "using SQLite directly", bytes);
+        return false;
+    }
+
+    hashes = (uint8_t*) malloc(bytes > 0 ? bytes : 1);
+    if (hashes == NULL) {
+        log_w("Could not allocate the in-RAM index, using SQLite directly");
+        return false;
+    }
+
+    int rc = sqlite3_prepare_v2(db, usersQuery, -1, &query, NULL);
+    if (rc != SQLITE_OK) {
+        log_w("Cannot read authorized users: %s", sqlite3_errmsg(db));
+        clear();
+        return false;
+    }
+
+    // A row with an invalid schedule does not authorize anybody
+    count = 0;
+    size_t invalid = 0;
+    rc = sqlite3_step(query);
+    while (rc == SQLITE_ROW and count < rows) {
+        uint8_t* record = hashes + count * recordSize;
+        uint16_t scheduleID = NO_SCHEDULE;
+        if (withSchedules and not scheduleFromColumn(query, 1, scheduleID)) {
+            ++invalid;
+        } else if (hashFromColumn(query, 0, record)) {
+            if (withSchedules) {
+                memcpy(record + HASH_SIZE, &scheduleID, sizeof(scheduleID));
+            }
+            ++count;
+        }
+        rc = sqlite3_step(query);
+    }
+    sqlite3_finalize(query);
+
+    if (invalid > 0) {
+        log_w("Ignoring %u authorizations with invalid schedules", invalid);
+    }
+
+    // If the DB changed under our feet, the index is not reliable
+    if (rc != SQLITE_DONE) {
+        log_w("Error reading authorized users: %s", sqlite3_errmsg(db));
+        clear();
+        return false;
+    }
+
+    qsort(hashes, count, recordSize, compareHashes);
+
+    // Remove duplicates (a user may be listed more than once); if the
+    // duplicates have different schedules, we let SQLite sort it out.
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t* record = hashes + i * recordSize;
+        uint8_t* previous = hashes + (unique > 0 ? unique -1 : 0) * recordSize;
+        if (unique > 0 and 0 == memcmp(previous, record, HASH_SIZE)) {
+            if (withSchedules and memcmp(previous + HASH_SIZE,
+                                         record + HASH_SIZE,
+                                         sizeof(uint16_t))) {
+
+                uint16_t mixed = MIXED_SCHEDULES;
+                memcpy(previous + HASH_SIZE, &mixed, sizeof(mixed));
+            }
+            continue;
+        }
+        if (unique != i) {
+            memcpy(hashes + unique * recordSize, record, recordSize);
+        }
+        ++unique;
+    }
+    count = unique;
+
+    log_i("In-RAM index built: %u hashes for door %d (%u rows), "
+          "%u bytes, %lu ms", count, doorID, rows, bytes, millis() - start);
+
+    return true;
+}
+
+void AuthIndex::clear() {
+    free(hashes);
+    hashes = NULL;
+    count = 0;
+}
+
+bool AuthIndex::contains(const uint8_t* binHash, uint16_t& scheduleID) {
+    scheduleID = NO_SCHEDULE;
+    if (hashes == NULL) { return false; }
+
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const uint8_t* record = hashes + mid * recordSize;
+        int cmp = memcmp(record, binHash, HASH_SIZE);
+        if (cmp == 0) {
+            if (recordSize > HASH_SIZE) {
+                memcpy(&scheduleID, record + HASH_SIZE, sizeof(scheduleID));
+            }
+            return true;
+        }
+        if (cmp < 0) {
+            low = mid +1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return false;
+}
+
+// The byte order does not matter, as long as we always use the same
+inline uint64_t hashPrefix(const uint8_t* binHash) {
+    uint64_t prefix;
+    memcpy(&prefix, binHash, sizeof(prefix));
+    return prefix;
+}
+
+int comparePrefixes(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+bool PrefixIndex::build(sqlite3* db, const char* usersQuery) {
+    clear();
+
+    unsigned long start = millis();
+    sqlite3_stmt* query;
+
+    size_t rows;
+    if (not countAuthorized(db, usersQuery, rows)) { return false; }
+
+    size_t bytes = rows * sizeof(uint64_t);
+    if (bytes > AUTH_PREFIX_INDEX_MAX_BYTES) {
+        log_i("Too many authorized users (%u) for the prefix index", rows);
+        return false;
+    }
+
+    if (bytes > heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 2) {
+        log_w("Not enough memory for the prefix index (%u bytes)", bytes);
+        return false;
+    }
+
+    prefixes = (uint64_t*) malloc(bytes > 0 ? bytes : 1);
+    if (prefixes == NULL) {
+        log_w("Could not allocate the prefix index");
+        return false;
+    }
+
+    int rc = sqlite3_prepare_v2(db, usersQuery, -1, &query, NULL);
+    if (rc != SQLITE_OK) {
+        log_w("Cannot read authorized users: %s", sqlite3_errmsg(db));
+        clear();
+        return false;
+    }
+
+    count = 0;
+    rc = sqlite3_step(query);
+    while (rc == SQLITE_ROW and count < rows) {
+        byte binHash[HASH_SIZE];
+        if (hashFromColumn(query, 0, binHash)) {
+            prefixes[count++] = hashPrefix(binHash);
+        }
+        rc = sqlite3_step(query);
+    }
+    sqlite3_finalize(query);
+
+    // A missing prefix would deny access to a valid user
+    if (rc != SQLITE_DONE) {
+        log_w("Error reading authorized users: %s", sqlite3_errmsg(db));
+        clear();
+        return false;
+    }
+
+    qsort(prefixes, count, sizeof(uint64_t), comparePrefixes);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (unique > 0 and prefixes[unique -1] == prefixes[i]) { continue; }
+        prefixes[unique++] = prefixes[i];
+    }
+    count = unique;
+
+    log_i("Prefix index built: %u prefixes for door %d (%u rows), "
+          "%u bytes, %lu ms", count, doorID, rows, bytes, millis() - start);
+
+    return true;
+}
+
+void PrefixIndex::clear() {
+    free(prefixes);
+    prefixes = NULL;
+    count = 0;
+}
+
+bool PrefixIndex::mightContain(const uint8_t* binHash) {
+    if (prefixes == NULL) { return true; }
+
+    uint64_t prefix = hashPrefix(binHash);
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (prefixes[mid] == prefix) { return true; }
+        if (prefixes[mid] < prefix) {
+            low = mid +1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return false;
+}
+
+// The hash we are checking is already a SHA-256 digest, so its bits are
+// as good as random. Therefore, instead of calculating k independent hash
+// functions, we use two 32-bit words from the digest to generate the k
+// bit positions ("double hashing", Kirsch & Mitzenmacher).
+#define BLOOM_POSITION(h1, h2, i, m) (((h1) + (i) * (h2)) % (m))
+
+inline void BloomFilter::add(const uint8_t* binHash) {
+    uint32_t h1, h2;
+    memcpy(&h1, binHash, 4);
+    memcpy(&h2, binHash +4, 4);
+    h2 |= 1;
+
+    for (uint32_t i = 0; i < numHashes; ++i) {
+        uint32_t pos = BLOOM_POSITION(h1, h2, i, numBits);
+        bits[pos / 8] |= 1 << (pos % 8);
+    }
+}
+
+bool BloomFilter::mightContain(const uint8_t* binHash) {
+    if (bits == NULL) { return true; }
+
+    uint32_t h1, h2;
+    memcpy(&h1, binHash, 4);
+    memcpy(&h2, binHash +4, 4);
+    h2 |= 1;
+
+    for (uint32_t i = 0; i < numHashes; ++i) {
+        uint32_t pos = BLOOM_POSITION(h1, h2, i, numBits);
+        if (not (bits[pos / 8] & (1 << (pos % 8)))) { return false; }
+    }
+
+    return true;
+}
+
+bool BloomFilter::build(sqlite3* db, const char* usersQuery) {
+    clear();
+
+    unsigned long start = millis();
+
+    size_t rows;
+    if (not countAuthorized(db, usersQuery, rows)) { return false; }
+
+    // Optimal size for the desired false positive rate p:
+    // m = -n ln(p) / ln(2)^2 bits and k = (m/n) ln(2) hash functions
+    double n = rows > 0 ? rows : 1;
+    double m = -n * log(AUTH_BLOOM_FP_RATE) / (M_LN2 * M_LN2);
+    if (m > AUTH_BLOOM_MAX_BYTES * 8.0) { m = AUTH_BLOOM_MAX_BYTES * 8.0; }
+    if (m < 64) { m = 64; }
+
+    size_t bytes = ((uint32_t) m + 7) / 8;
+    numBits = bytes * 8;
+
+    int k = (int) round(numBits / n * M_LN2);
+    if (k < 1) { k = 1; }
+    if (k > 16) { k = 16; }
+    numHashes = k;
+
+    if (bytes > heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 2) {
+        log_w("Not enough memory for the Bloom filter (%u bytes)", bytes);
+        numBits = 0;
+        return false;
+    }
+
+    bits = (uint8_t*) calloc(bytes, 1);
+    if (bits == NULL) {
+        log_w("Could not allocate the Bloom filter");
+        numBits = 0;
+        return false;
+    }
+
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(db, usersQuery, -1, &query, NULL);
+    if (rc != SQLITE_OK) {
+        log_w("Cannot read authorized users: %s", sqlite3_errmsg(db));
+        clear();
+        return false;
+    }
+
+    rc = sqlite3_step(query);
+    while (rc == SQLITE_ROW) {
+        byte binHash[HASH_SIZE];
+        if (hashFromColumn(query, 0, binHash)) { add(binHash); }
+        rc = sqlite3_step(query);
+    }
+    sqlite3_finalize(query);
+
+    // A filter missing some hashes would deny access to valid users
+    if (rc != SQLITE_DONE) {
+        log_w("Error reading authorized users: %s", sqlite3_errmsg(db));
+        clear();
+        return false;
+    }
+
+    double fpRate = pow(1 - exp(-k * n / numBits), k);
+    log_i("Bloom filter built: %u rows for door %d, %u bytes, %d hashes, "
+          "expected false positive rate %.4f, %lu ms",
+          rows, doorID, bytes, k, fpRate, millis() - start);
+
+    return true;
+}
+
+void BloomFilter::clear() {
+    free(bits);
+    bits = NULL;
+    numBits = 0;
+    numHashes = 0;
+}
@@ -1,10 +1,22 @@
 static const char *TAG = "auth";
 
 #include <tramela.h>
-#include "mbedtls/md.h"
 #include <Arduino.h>
 #include <sqlite3.h>
+#include <authorizer.h> // DB_SHARDS, dbShard()
 #include <firmwareOTA.h> // forceFirmwareRollback()
+#include <authindex.h>
+#include <flatindex.h>
+#include <authsnapshot.h>
+#include <cardhash.h>
+#include <rawdb.h>
+#include <sqlitemem.h> // logSQLiteMemory()
+#include <schedules.h>
+#include <timemanager.h> // getTime()
+#include <nvs.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 
 const char* master_keys[] = {
     "3acce68667c2d4bafedb366ef9c221ebdf3ca9df1838b655603ee107d968f3c4",
@@ -19,57 +31,558 @@ const char* rollback_keys[] = {
     "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
 };
 
+// Most people swipe the same doors many times a day, so we remember the
+// last few decisions, indexed by the card ID received from the reader.
+// This allows us to skip both calculating the hash and querying the DB.
+// The cache must be cleared whenever the DB changes; since this happens
+// in a different task (the MQTT one), clearing simply increments the
+// "generation" counter, which invalidates all current entries at once.
+// We use the CLOCK algorithm to choose which entry to replace.
+#ifndef DECISION_CACHE_SIZE
+#define DECISION_CACHE_SIZE 16
+#endif
+
+// Check Authorizer::warmUp(); AUTH_WARMUP_PROBES = 0 disables it
+#ifndef AUTH_WARMUP_PROBES
+#define AUTH_WARMUP_PROBES 256
+#endif
+
+#ifndef AUTH_WARMUP_MAX_MS
+#define AUTH_WARMUP_MAX_MS 10000
+#endif
+
+// By default, what the SQLite page cache pool holds (check sqlitemem.h):
+// beyond that, SQLite would evict the pages the warm-up just loaded
+#ifndef AUTH_WARMUP_MAX_BYTES
+#   if SQLITE_ARENA_SIZE > 0
+#   define AUTH_WARMUP_MAX_BYTES (SQLITE_PAGECACHE_PAGES * SQLITE_PAGE_SIZE)
+#   else
+#   define AUTH_WARMUP_MAX_BYTES 131072
+#   endif
+#endif
+
+static_assert(SQLITE_ARENA_SIZE == 0 or AUTH_WARMUP_MAX_BYTES
+                  <= SQLITE_PAGECACHE_PAGES * SQLITE_PAGE_SIZE,
+              "AUTH_WARMUP_MAX_BYTES must fit in the SQLite page cache pool");
+
+// With DB_SHARDS > 1, check Authorizer::loadShard()
+#ifndef DB_SHARDS_OPEN
+#define DB_SHARDS_OPEN 2
+#endif
+
+#ifndef DB_SHARD_CACHE_KB
+#define DB_SHARD_CACHE_KB 16
+#endif
+
+class DecisionCache {
+    public:
+        inline void clear() { ++generation; };
+        inline uint32_t currentGeneration() { return generation; };
+        int recentHashes(char hashes[][65]);
+        bool find(unsigned long cardID, char* hashBuf, bool& authorized);
+        void store(unsigned long cardID, const char* hash, bool authorized,
+                   uint32_t generation);
+    private:
+        struct Entry {
+            unsigned long cardID;
+            char hash[65];
+            bool authorized;
+            bool referenced;
+            uint32_t generation; // entry is valid if this is current
+        };
+        Entry entries[DECISION_CACHE_SIZE];
+        int hand = 0;
+        volatile uint32_t generation = 1; // entries start invalid (zeroed)
+};
+
+bool DecisionCache::find(unsigned long cardID, char* hashBuf,
+                         bool& authorized) {
+
+    uint32_t current = generation;
+    for (int i = 0; i < DECISION_CACHE_SIZE; ++i) {
+        Entry& e = entries[i];
+        if (e.generation == current and e.cardID == cardID) {
+            e.referenced = true;
+            strncpy(hashBuf, e.hash, 65);
+            authorized = e.authorized;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The hashes of the cards read recently, even if the decisions are no
+// longer valid; this is only a hint, so we do not care if an entry is
+// replaced while we copy it.
+int DecisionCache::recentHashes(char hashes[][65]) {
+    int n = 0;
+    for (int i = 0; i < DECISION_CACHE_SIZE; ++i) {
+        if (entries[i].generation == 0) { continue; } // never used
+        strncpy(hashes[n], entries[i].hash, 65);
+        hashes[n][64] = 0;
+        ++n;
+    }
+    return n;
+}
+
+// "generation" should be obtained *before* querying the DB: if the DB
+// changes in the meantime, the decision will not be reused.
+void DecisionCache::store(unsigned long cardID, const char* hash,
+                          bool authorized, uint32_t generation) {
+
+    while (entries[hand].generation == this->generation
+                                        and entries[hand].referenced) {
+        entries[hand].referenced = false;
+        hand = (hand +1) % DECISION_CACHE_SIZE;
+    }
+
+    Entry& e = entries[hand];
+    e.cardID = cardID;
+    strncpy(e.hash, hash, 65);
+    e.authorized = authorized;
+    e.referenced = false;
+    e.generation = generation;
+    hand = (hand +1) % DECISION_CACHE_SIZE;
+}
+
+// Everything that depends on the DB file: the connection, the prepared
+// statement, the schema and the in-RAM structures built from it. The
+// Authorizer keeps two of these, so it may open and prepare a new DB
+// while it still answers queries with the old one.
+class AuthDB {
+    public:
+        int open(const char *filename, int slot);
+        void buildIndexes();
+        void close();
+
+        sqlite3 *sqlitedb = NULL;
+        sqlite3_stmt *dbquery = NULL;
+        unsigned int version = 0; // "PRAGMA user_version" (or its alias)
+        char filename[32];
+
+        // With DB_RAW_PARTITION, "sqlitedb" reads the DB from this slot
+        // of the raw DB partition instead of the file (check rawdb.cpp)
+        int slot;
+        bool fromRawSlot = false;
+
+        // With DB_SHARDS > 1, the shard in this object (-1 if none) and
+        // when it was last used (check Authorizer::loadShard())
+        int shard = -1;
+        uint32_t lastUse = 0;
+
+        // Schema v2 stores the hashes as 32-byte BLOBs instead of TEXT
+        bool binaryKeys = false;
+
+        // Some users may only enter at certain times (check schedules.cpp)
+        bool hasSchedules = false;
+        ScheduleTable schedules;
+
+        // "auth" may refer to door groups instead of doors and the door
+        // may be open to anybody in "users" (check buildQueries())
+        bool byGroup = false;
+        bool anybody = false;
+        char usersQuery[AUTH_QUERY_SIZE];
+
+        // If possible, we answer queries from RAM instead of from SQLite
+        AuthIndex index;
+
+        // If the index is not available, we use one of these to avoid
+        // querying SQLite for most cards that are not authorized
+        PrefixIndex prefixIndex;
+        BloomFilter bloom; // Only if the prefix index is not available
+
+    private:
+        void detectSchema();
+        bool buildQueries(char* lookupQuery, size_t size);
+        bool openToAnybody();
+        bool appendGroups(char* condition, size_t size);
+        unsigned int readVersion();
+};
+
+struct BenchmarkTarget;
+
+// The DB we activated last, saved in NVS (check Authorizer::saveLastDB())
+#define LAST_DB_NVS_KEY "lastdb"
+typedef struct {
+    uint32_t version;
+    uint32_t hasSchedules;
+} LastDBRecord;
+
 // This is a wrapper around SQLite which allows us
 // to query whether a user is authorized to enter.
 class Authorizer {
     public:
-        int openDB(const char *filename);
+        int openDB(const char *filename, int shard);
         inline void closeDB();
-        inline bool userAuthorized(const char* readerID, const char* cardHash);
+        inline void closeDB(int shard);
+        void openFlatIndex();
+        void closeFlatIndex();
+        void setShardsVersion(unsigned int version);
+        void aliasDBVersion(unsigned int fileVersion, unsigned int version);
+        void loadSnapshot();
+        inline bool userAuthorized(const char* readerID, const byte* binHash,
+                                   const char* cardHash);
+        inline bool cardAuthorized(const char* readerID, unsigned long cardID,
+                                   char* hashBuf);
         inline void refreshQuery();
-        inline void calculate_hash(unsigned long cardID, char* hashBuf);
+        inline void calculate_hash(unsigned long cardID, byte* binHash);
+        inline void hashToHex(const byte* binHash, char* hashBuf);
+        void logStats();
+        void benchmarkHash();
+        void benchmarkDB();
+        void benchmarkCache();
+        inline unsigned int currentDBVersion();
+        void warmUp();
     private:
-        // check the comment near Authorizer::closeDB()
-        sqlite3 *sqlitedb = NULL;
-        sqlite3_stmt *dbquery = NULL;
+        // check the comment near Authorizer::openDB()
+        AuthDB dbs[2];
+        AuthDB* volatile activeDB = NULL;
+        volatile bool hasSchedules = false; // same as activeDB->hasSchedules
+        unsigned int aliasedFileVersion = 0; // check aliasDBVersion()
+        unsigned int aliasedVersion = 0;
+        SemaphoreHandle_t dbLock = NULL;
+        inline AuthDB* switchDB(AuthDB* newDB);
+        inline AuthDB* lockDB();
+        inline bool queryDB(AuthDB* db, const byte* binHash,
+                            const char* cardHash, bool checkedFilter);
+
+#if DB_SHARDS > 1
+        // check the comment near Authorizer::loadShard()
+        char shardFiles[DB_SHARDS][16] = {}; // empty if we have no file
+        AuthDB shardDBs[DB_SHARDS_OPEN];
+        uint32_t shardUses = 0;
+        int openShard(const char* filename, int shard);
+        AuthDB* loadShard(int shard);
+        inline AuthDB* lockShard(const byte* binHash);
+#endif
+
+        // check the comment near Authorizer::benchmarkTarget()
+        bool benchmarkTarget(BenchmarkTarget& target);
+        bool openBenchmarkDB(const BenchmarkTarget& target, sqlite3** db);
+        int timeLookups(sqlite3* db, const char* sql, bool binaryKeys,
+                        const byte* keys, int n, unsigned long* times);
+        void benchmarkLookups(const char* label, sqlite3* db,
+                              const BenchmarkTarget& target,
+                              const byte* keys);
+        int sampleAuthorized(sqlite3* db, const char* usersQuery,
+                             byte* hashes, int max);
+
+        // check the comment near Authorizer::warmUp()
+        volatile uint32_t dbGeneration = 0; // incremented by switchDB()
+        TaskHandle_t warmUpTask = NULL;
+        void startWarmUp();
+        bool warmUpKey(sqlite3_stmt* query, const byte* binHash,
+                       bool binaryKeys, uint32_t generation,
+                       unsigned long start, int maxCacheUsed);
+
+        // If the server sent us a flat index, we use it instead of SQLite,
+        // but only if it was generated from the same version of the DB
+        FlatIndex flatIndex;
+        bool flatIndexMatches(unsigned int version);
+        unsigned int shardsVersion = 0; // check setShardsVersion()
+
+        // What we know about the last DB we activated, for when we have
+        // no DB (check Authorizer::openFlatIndex())
+        LastDBRecord lastDB = {};
+        bool lastDBKnown = false;
+        void saveLastDB(unsigned int version, bool withSchedules);
+        void useLastDB();
+
+        // The users of the last DB we opened, for when there is no DB
+        AuthSnapshot snapshot;
+
+        // So we can check how effective the filters are
+        uint32_t filterQueries = 0;
+        uint32_t filterRejected = 0;
+        uint32_t filterFalsePositives = 0;
+
+        // Recent decisions, so we can skip the hash and the query
+        DecisionCache cache;
+        bool decisionFromDB; // false for master keys, errors, schedules etc.
+        uint32_t cacheHits = 0;
+        uint32_t cacheMisses = 0;
 };
 
-int Authorizer::openDB(const char *filename) {
-    closeDB();
-    char name[50];
+/*
+  When the DB file changes (check dbmanager.cpp), we open and prepare the
+  new one, including the in-RAM index etc., while the old one is still in
+  use. Then we switch "activeDB" to the new one and only then close the
+  old one. The switch happens with "dbLock" held, which userAuthorized()
+  also holds while it uses the DB, so the old DB is never closed in the
+  middle of a query and a card read during the update is answered as
+  fast as usual. The price is that, for a moment, we have both DBs (and
+  their indexes) in RAM; if the new index does not fit, we use the
+  prefix index or the Bloom filter, as usual.
+*/
+int Authorizer::openDB(const char *filename, int shard) {
+    if (dbLock == NULL) { dbLock = xSemaphoreCreateMutex(); }
+
+#   if DB_SHARDS > 1
+    return openShard(filename, shard);
+#   endif
+
+    AuthDB* newDB = activeDB == &dbs[0] ? &dbs[1] : &dbs[0];
+    int rc = newDB->open(filename, newDB - dbs);
+    if (rc != SQLITE_OK) { return rc; }
+    if (aliasedVersion != 0 and newDB->version == aliasedFileVersion) {
+        newDB->version = aliasedVersion;
+    }
+
+    // If this fails, we use SQLite; if the flat index
+    // is available, we do not need this at all
+    if (not flatIndex.available()) { flatIndex.open(); }
+    if (flatIndexMatches(newDB->version)) {
+        log_d("Using the flat index, no need for an in-RAM index");
+    } else {
+        newDB->buildIndexes();
+    }
+
+    // The peak is with both DBs open, so we log it before closing the old one
+    logSQLiteMemory();
+
+    snapshot.save(newDB->sqlitedb, newDB->usersQuery, newDB->hasSchedules);
+
+    AuthDB* oldDB = switchDB(newDB);
+    if (oldDB != NULL) { oldDB->close(); }
+    snapshot.clear();
+    saveLastDB(newDB->version, newDB->hasSchedules);
+
+    startWarmUp();
+
+    return rc;
+}
+
+static void diskPath(const char* filename, char* name, size_t size) {
 #   ifdef USE_SD
-    snprintf(name, 50, "/sd%s", filename);
+    snprintf(name, size, "/sd%s", filename);
 #   else
-    snprintf(name, 50, "/ffat%s", filename);
+    snprintf(name, size, "/ffat%s", filename);
+#   endif
+}
+
+int AuthDB::open(const char *filename, int slot) {
+    close();
+    snprintf(this->filename, sizeof(this->filename), "%s", filename);
+    this->slot = slot;
+    char name[50];
+    diskPath(filename, name, sizeof(name));
+
+#   ifdef DB_RAW_PARTITION
+    // Shards (slot -1) are always read from their files
+    if (slot >= 0 and copyToRawSlot(filename, slot)) {
+        fromRawSlot = openRawSlot(slot, &sqlitedb) == SQLITE_OK;
+        if (not fromRawSlot) {
+            log_w("Can't open raw DB slot %d: %s", slot,
+                  sqlite3_errmsg(sqlitedb));
+            close();
+        }
+    }
+    if (slot >= 0 and not fromRawSlot) {
+        log_w("Reading the DB from %s instead", name);
+    }
 #   endif
 
-    int rc = sqlite3_open(name, &sqlitedb);
+    int rc = fromRawSlot ? SQLITE_OK : sqlite3_open(name, &sqlitedb);
     if (rc != SQLITE_OK)
     {
         log_e("Can't open database: %s", sqlite3_errmsg(sqlitedb));
-    } else {
-        log_d("Opened database successfully %s", filename);
-        rc = sqlite3_prepare_v2(sqlitedb,
-                                "SELECT EXISTS(SELECT * FROM auth "
-                                "WHERE userID=? AND doorID=?)",
-                                -1, &dbquery, NULL);
-
-        if (rc != SQLITE_OK) {
-            log_e("Can't generate prepared statement: %s: %s",
-                  sqlite3_errstr(sqlite3_extended_errcode(sqlitedb)),
-                  sqlite3_errmsg(sqlitedb));
-        } else {
-            log_d("Prepared statement created");
-        }
+        close();
+        return rc;
+    }
+
+    log_d("Opened database successfully %s%s", filename,
+          fromRawSlot ? " from the raw DB partition" : "");
+    detectSchema();
+    log_i("DB uses schema %s%s", binaryKeys ? "v2 (BLOB keys)"
+                                           : "v1 (TEXT keys)",
+          hasSchedules ? " with schedules" : "");
+
+    char lookupQuery[AUTH_QUERY_SIZE];
+    if (not buildQueries(lookupQuery, sizeof(lookupQuery))) {
+        close();
+        return SQLITE_ERROR;
+    }
+
+    if (hasSchedules) { schedules.build(sqlitedb); }
+
+    rc = sqlite3_prepare_v2(sqlitedb, lookupQuery, -1, &dbquery, NULL);
+
+    if (rc != SQLITE_OK) {
+        log_e("Can't generate prepared statement: %s: %s",
+              sqlite3_errstr(sqlite3_extended_errcode(sqlitedb)),
+              sqlite3_errmsg(sqlitedb));
+        close();
+        return rc;
     }
 
+    log_d("Prepared statement created");
+    version = readVersion();
+    log_i("DB version %u", version);
+
     return rc;
 }
 
-// search element through current database
+void AuthDB::buildIndexes() {
+    if (not index.build(sqlitedb, usersQuery, hasSchedules)
+            and not prefixIndex.build(sqlitedb, usersQuery)) {
+        bloom.build(sqlitedb, usersQuery);
+    }
+}
+
+// Schema v1 stores hashes as hexadecimal TEXT and schema v2 as BLOBs;
+// we check the declared type of "auth.userID" to tell them apart. Any
+// of them may also have the "auth.schedule" column and may have
+// "auth.groupID" instead of "auth.doorID".
+void AuthDB::detectSchema() {
+    binaryKeys = false;
+    hasSchedules = false;
+    byGroup = false;
+
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(sqlitedb, "PRAGMA table_info(auth)",
+                                -1, &query, NULL);
+    if (rc != SQLITE_OK) { return; }
+
+    while (sqlite3_step(query) == SQLITE_ROW) {
+        const char* name = (const char*) sqlite3_column_text(query, 1);
+        const char* type = (const char*) sqlite3_column_text(query, 2);
+        if (name == NULL or type == NULL) { continue; }
+        if (!strcasecmp(name, "userID")) {
+            binaryKeys = !strcasecmp(type, "BLOB");
+        } else if (!strcasecmp(name, "schedule")) {
+            hasSchedules = true;
+        } else if (!strcasecmp(name, "groupID")) {
+            byGroup = true;
+        }
+    }
+    sqlite3_finalize(query);
+}
+
+/*
+  With many doors, listing each authorized user for each door makes the
+  "auth" table (and the DB file) huge. So, the DB may instead assign
+  doors to groups ("groups" table: ID, doorID; a door may belong to any
+  number of groups) and authorize users for groups ("auth.groupID"
+  instead of "auth.doorID"). Also, a door may be open to any registered
+  user ("doors.anybody"), in which case "auth" is not used at all for
+  this door (and neither are schedules).
+
+  This only depends on the DB, so we resolve it once when the DB is
+  opened, generating:
+
+  * "usersQuery", which lists the users authorized for this door, with
+    their schedules (if any), to build the in-RAM index etc.;
+
+  * the query used to check a single user (the prepared statement).
+
+  Both embed the door/group IDs directly, so SQLite does not need to
+  join anything for each card.
+*/
+bool AuthDB::buildQueries(char* lookupQuery, size_t size) {
+    anybody = openToAnybody();
+    if (anybody) {
+        log_i("Door %d is open to any registered user", doorID);
+        hasSchedules = false;
+        snprintf(usersQuery, sizeof(usersQuery), "SELECT ID FROM users");
+        snprintf(lookupQuery, size,
+                 "SELECT EXISTS(SELECT * FROM users WHERE ID=?)");
+        return true;
+    }
+
+    char condition[AUTH_QUERY_SIZE];
+    if (not byGroup) {
+        snprintf(condition, sizeof(condition), "doorID=%d", doorID);
+    } else if (not appendGroups(condition, sizeof(condition))) {
+        return false;
+    }
+
+    int len = snprintf(usersQuery, sizeof(usersQuery),
+                       "SELECT userID%s FROM auth WHERE %s",
+                       hasSchedules ? ", schedule" : "", condition);
+
+    // With schedules, a user may be listed more than once for
+    // this door, each time with a different schedule
+    int len2;
+    if (hasSchedules) {
+        len2 = snprintf(lookupQuery, size, "SELECT schedule FROM auth "
+                        "WHERE userID=? AND %s", condition);
+    } else {
+        len2 = snprintf(lookupQuery, size, "SELECT EXISTS(SELECT * FROM auth "
+                        "WHERE userID=? AND %s)", condition);
+    }
+
+    if (len >= sizeof(usersQuery) or len2 >= size) {
+        log_e("Door %d belongs to too many groups", doorID);
+        return false;
+    }
+
+    return true;
+}
+
+bool AuthDB::openToAnybody() {
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(sqlitedb, "SELECT anybody FROM doors "
+                                          "WHERE ID=?", -1, &query, NULL);
+
+    // Older DBs do not have this column
+    if (rc != SQLITE_OK) { return false; }
+
+    sqlite3_bind_int(query, 1, doorID);
+    bool result = sqlite3_step(query) == SQLITE_ROW
+                    and sqlite3_column_int(query, 0) != 0;
+    sqlite3_finalize(query);
+
+    return result;
+}
+
+// Generates "groupID IN (a, b, ...)" with the groups of this door
+bool AuthDB::appendGroups(char* condition, size_t size) {
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(sqlitedb, "SELECT ID FROM groups "
+                                          "WHERE doorID=?", -1, &query, NULL);
+    if (rc != SQLITE_OK) {
+        log_e("Cannot read door groups: %s", sqlite3_errmsg(sqlitedb));
+        return false;
+    }
+
+    sqlite3_bind_int(query, 1, doorID);
+    size_t len = snprintf(condition, size, "groupID IN (");
+    int groups = 0;
+    rc = sqlite3_step(query);
+    while (rc == SQLITE_ROW and len < size) {
+        len += snprintf(condition + len, size - len, "%s%d",
+                        groups > 0 ? "," : "", sqlite3_column_int(query, 0));
+        ++groups;
+        rc = sqlite3_step(query);
+    }
+    sqlite3_finalize(query);
+
+    if (len < size) {
+        len += snprintf(condition + len, size - len, ")");
+    }
+
+    if (len >= size) {
+        log_e("Door %d belongs to too many groups", doorID);
+        return false;
+    }
+
+    if (rc != SQLITE_DONE) {
+        log_e("Error reading door groups: %s", sqlite3_errmsg(sqlitedb));
+        return false;
+    }
+
+    log_i("Door %d belongs to %d groups", doorID, groups);
+    return true;
+}
+
+// search element through current database; we receive the
+// hash both in binary and hexadecimal forms.
 inline bool Authorizer::userAuthorized(const char* readerID,
+                                       const byte* binHash,
                                        const char* cardHash) {
 
+    decisionFromDB = false;
+
     // MASTER IDs are defined at the beginning of this file.
     for (int i = 0; i < sizeof(master_keys)/sizeof(master_keys[0]); ++i) {
         if (!strcmp(cardHash, master_keys[i])) {
@@ -95,13 +608,31 @@ inline bool Authorizer::userAuthorized(const char* readerID,
         }
     }
 
-    // This is necessary because someone might open the door during
-    // our DB file swap. We wait for up to 500 milliseconds for the
-    // swap to complete.
-    unsigned long start = millis();
-    while (sqlitedb == NULL && millis() - start < 500) { delay(20); }
+    // The flat index is independent from the DB, so we do not need to
+    // wait for the DB if we have it. It has no schedules, though, so if
+    // the DB has them we need to check it for the users it finds.
+    bool checkedFilter = false;
+    bool found;
+    if (flatIndex.lookup(binHash, found)) {
+        if (not found or not hasSchedules) {
+            decisionFromDB = true;
+            return found;
+        }
+        checkedFilter = true;
+    }
+
+    // Without a DB, we still know the users of the last one we opened
+    if (activeDB == NULL and snapshot.contains(binHash)) {
+        log_d("No DB, user found in the authorization snapshot");
+        return true;
+    }
 
-    if (sqlitedb == NULL) {
+#   if DB_SHARDS > 1
+    AuthDB* db = lockShard(binHash);
+#   else
+    AuthDB* db = lockDB();
+#   endif
+    if (db == NULL) {
         log_e("Cannot read DB, denying access");
         return false;
     }
@@ -109,76 +640,948 @@ inline bool Authorizer::userAuthorized(const char* readerID,
     log_d("Card reader %s was used. Received card hash %s",
            readerID, cardHash);
 
-    sqlite3_bind_text(dbquery, 1, cardHash, strlen(cardHash), NULL);
-    sqlite3_bind_int(dbquery, 2, doorID);
+    bool authorized = queryDB(db, binHash, cardHash, checkedFilter);
+    xSemaphoreGive(dbLock);
+    return authorized;
+}
+
+// Returns the DB in use with "dbLock" held, or NULL (without the lock).
+// Every update (full download, SQL delta, patch) opens the new DB next to
+// the current one and switches to it with switchDB(), so "activeDB" is
+// only NULL when there really is no DB and there is nothing to wait for.
+inline AuthDB* Authorizer::lockDB() {
+    if (dbLock == NULL) { return NULL; }
+
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    if (activeDB != NULL) { return activeDB; }
+    xSemaphoreGive(dbLock);
+
+    return NULL;
+}
+
+#if DB_SHARDS > 1
+/*
+  With DB_SHARDS > 1, each shard is a complete DB (same schema, with all
+  the doors and groups) with only the users whose hashes start with some
+  bits, and it is updated on its own (check dbmanager.cpp). There is no
+  "activeDB": openDB() only checks that the new file of a shard opens
+  and remembers it, and each card is looked up in its shard, which is
+  opened only when we need it. We keep up to DB_SHARDS_OPEN of them open
+  (the ones used most recently), each with a page cache of at most
+  DB_SHARD_CACHE_KB, and we do not build in-RAM indexes or filters for
+  them; the warm-up, the benchmarks and the SQL deltas only work with a
+  single DB. The shards have no DB version, so the DB manager tells us
+  which version they are at (check setShardsVersion()) to compare it with
+  the flat index. Schedules are defined by the tables every shard has,
+  so each shard we load tells us whether there are any.
+
+  Everything here happens with "dbLock" held, so a card read waits while
+  a shard is opened; this takes much less than opening a large DB.
+*/
+int Authorizer::openShard(const char* filename, int shard) {
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    for (int i = 0; i < DB_SHARDS_OPEN; ++i) {
+        if (shardDBs[i].shard == shard) { shardDBs[i].close(); }
+    }
+
+    // If the new file fails, we keep the previous one, as with a single DB
+    char previous[sizeof(shardFiles[shard])];
+    memcpy(previous, shardFiles[shard], sizeof(previous));
+    snprintf(shardFiles[shard], sizeof(shardFiles[shard]), "%s", filename);
+
+    cache.clear();
+    AuthDB* db = loadShard(shard);
+    if (db == NULL) {
+        memcpy(shardFiles[shard], previous, sizeof(previous));
+    }
+    xSemaphoreGive(dbLock);
+
+    return db == NULL ? SQLITE_CANTOPEN : SQLITE_OK;
+}
+
+// Must be called with "dbLock" held; closes the least recently
+// used shard if needed
+AuthDB* Authorizer::loadShard(int shard) {
+    AuthDB* lru = &shardDBs[0];
+    for (int i = 0; i < DB_SHARDS_OPEN; ++i) {
+        AuthDB* db = &shardDBs[i];
+        if (db->shard == shard) {
+            db->lastUse = ++shardUses;
+            return db;
+        }
+        if (db->lastUse < lru->lastUse) { lru = db; }
+    }
+
+    if (shardFiles[shard][0] == 0) { return NULL; }
+
+    if (lru->open(shardFiles[shard], -1) != SQLITE_OK) { return NULL; }
+
+    char pragma[40];
+    snprintf(pragma, sizeof(pragma), "PRAGMA cache_size=-%d",
+             DB_SHARD_CACHE_KB);
+    sqlite3_exec(lru->sqlitedb, pragma, NULL, NULL, NULL);
+
+    lru->shard = shard;
+    lru->lastUse = ++shardUses;
+    hasSchedules = lru->hasSchedules;
+    return lru;
+}
+
+// Same as lockDB(), with the shard "binHash" belongs to
+inline AuthDB* Authorizer::lockShard(const byte* binHash) {
+    if (dbLock == NULL) { return NULL; }
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    AuthDB* db = loadShard(dbShard(binHash));
+    if (db == NULL) { xSemaphoreGive(dbLock); }
+    return db;
+}
+#endif
+
+// Must be called with "dbLock" held
+inline bool Authorizer::queryDB(AuthDB* db, const byte* binHash,
+                                const char* cardHash, bool checkedFilter) {
+
+    if (db->index.available()) {
+        uint16_t scheduleID;
+        if (not db->index.contains(binHash, scheduleID)) {
+            decisionFromDB = true;
+            return false;
+        }
+
+        if (scheduleID == NO_SCHEDULE) {
+            decisionFromDB = true;
+            return true;
+        }
+
+        // Decisions that depend on the time should not be cached
+        if (scheduleID != MIXED_SCHEDULES) {
+            return db->schedules.allows(scheduleID, getTime());
+        }
+        checkedFilter = true; // Let SQLite check all the schedules
+    }
+
+    if (not checkedFilter and (db->prefixIndex.available()
+                               or db->bloom.available())) {
+        ++filterQueries;
+        if (not db->prefixIndex.mightContain(binHash)
+                or not db->bloom.mightContain(binHash)) {
+
+            ++filterRejected;
+            decisionFromDB = true;
+            return false;
+        }
+        checkedFilter = true;
+    }
+
+    sqlite3_stmt* dbquery = db->dbquery;
+    if (db->binaryKeys) {
+        sqlite3_bind_blob(dbquery, 1, binHash, HASH_SIZE, NULL);
+    } else {
+        sqlite3_bind_text(dbquery, 1, cardHash, strlen(cardHash), NULL);
+    }
 
     bool authorized = false;
+    bool found = false;
+    bool restricted = false;
     int rc = sqlite3_step(dbquery);
     while (rc == SQLITE_ROW) {
-        if (1 == sqlite3_column_int(dbquery, 0))
-            authorized = true;
+        if (not db->hasSchedules) {
+            if (1 == sqlite3_column_int(dbquery, 0)) { found = true; }
+        } else {
+            found = true;
+            uint16_t scheduleID;
+            if (not scheduleFromColumn(dbquery, 0, scheduleID)) {
+                log_w("Invalid schedule in the DB, denying access");
+            } else {
+                if (scheduleID != NO_SCHEDULE) { restricted = true; }
+                if (db->schedules.allows(scheduleID, getTime())) {
+                    authorized = true;
+                }
+            }
+        }
         rc = sqlite3_step(dbquery);
     }
+    if (not db->hasSchedules) { authorized = found; }
 
     if (rc != SQLITE_DONE) {
-        log_e("Error querying DB: %s", sqlite3_errmsg(sqlitedb));
+        log_e("Error querying DB: %s", sqlite3_errmsg(db->sqlitedb));
+        return authorized;
+    }
+
+    if (checkedFilter and not found) { ++filterFalsePositives; }
+
+    // Decisions that depend on the time should not be cached
+    decisionFromDB = not restricted;
+    return authorized;
+}
+
+// Same as calculate_hash() + userAuthorized(), but reusing a recent
+// decision for the same card if possible. We only remember decisions
+// that came from the DB: the master/reboot/rollback keys should always
+// be processed and errors should not "stick".
+inline bool Authorizer::cardAuthorized(const char* readerID,
+                                       unsigned long cardID, char* hashBuf) {
+
+    bool authorized;
+    if (cache.find(cardID, hashBuf, authorized)) {
+        ++cacheHits;
+        log_d("Card reader %s was used. Cached decision for card hash %s",
+              readerID, hashBuf);
+        return authorized;
+    }
+
+    ++cacheMisses;
+    uint32_t generation = cache.currentGeneration();
+    byte binHash[HASH_SIZE];
+    calculate_hash(cardID, binHash);
+    hashToHex(binHash, hashBuf);
+    authorized = userAuthorized(readerID, binHash, hashBuf);
+    if (decisionFromDB) {
+        cache.store(cardID, hashBuf, authorized, generation);
     }
 
     return authorized;
 }
 
+// check cardhash.cpp
 inline void Authorizer::calculate_hash(unsigned long cardID,
-                                       char* hashBuf) {
+                                       byte* binHash) {
+    cardHash(cardID, binHash);
+}
 
-    // Initialize the sha256 generator
-    mbedtls_md_context_t ctx;
-    mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
-    mbedtls_md_init(&ctx);
-    mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(md_type), 0);
-    mbedtls_md_starts(&ctx);
+inline void Authorizer::hashToHex(const byte* binHash, char* hashBuf) {
+    cardHashToHex(binHash, hashBuf);
+}
 
-    // Convert the cardID to a string (10-digit number) and hash it
-    char buf[11]; // 10 digits + '\0'
-    sprintf(buf, "%10lu", cardID);
-    mbedtls_md_update(&ctx, (const unsigned char *) buf, 10);
+// Measures how long calculate_hash() and hashToHex() take, in CPU cycles
+#define HASH_BENCHMARK_ROUNDS 1000
 
-    // Save the resulting binary hash and close the sha256 generator
-    byte binHash[32];
-    mbedtls_md_finish(&ctx, binHash);
-    mbedtls_md_free(&ctx);
+void Authorizer::benchmarkHash() {
+    byte binHash[HASH_SIZE];
+    char hashBuf[2 * HASH_SIZE +1];
 
-    // Convert the binary hash to a string (hexadecimal representation)
-    for(int i = 0; i < 32; ++i){
-        snprintf(hashBuf + 2*i, 3, "%02hhx", binHash[i]);
+    uint32_t start = ESP.getCycleCount();
+    for (unsigned long i = 0; i < HASH_BENCHMARK_ROUNDS; ++i) {
+        calculate_hash(i * 2654435761UL, binHash);
     }
+    uint32_t hashCycles = ESP.getCycleCount() - start;
+
+    start = ESP.getCycleCount();
+    for (int i = 0; i < HASH_BENCHMARK_ROUNDS; ++i) {
+        hashToHex(binHash, hashBuf);
+    }
+    uint32_t hexCycles = ESP.getCycleCount() - start;
+
+    log_i("Card hashing: %u cycles per hash, %u cycles per hex encoding "
+          "(CPU at %u MHz)", hashCycles / HASH_BENCHMARK_ROUNDS,
+          hexCycles / HASH_BENCHMARK_ROUNDS, ESP.getCpuFreqMHz());
+}
+
+// Benchmarks of the SQLite lookups, with new connections to the DB in use
+// (from the raw DB partition or from its file, like the Authorizer), so
+// we do not hold "dbLock" while they run. They must run in the same task
+// as openDB() (the MQTT one); otherwise, the DB might change meanwhile.
+struct BenchmarkTarget {
+    char lookupQuery[AUTH_QUERY_SIZE];
+    char usersQuery[AUTH_QUERY_SIZE];
+    char name[50];
+    int slot;
+    bool binaryKeys;
+    bool fromRawSlot;
+};
+
+bool Authorizer::benchmarkTarget(BenchmarkTarget& target) {
+    AuthDB* db = lockDB();
+    if (db == NULL) {
+        log_w("No DB to benchmark");
+        return false;
+    }
+    snprintf(target.lookupQuery, sizeof(target.lookupQuery), "%s",
+             sqlite3_sql(db->dbquery));
+    snprintf(target.usersQuery, sizeof(target.usersQuery), "%s",
+             db->usersQuery);
+    diskPath(db->filename, target.name, sizeof(target.name));
+    target.slot = db->slot;
+    target.binaryKeys = db->binaryKeys;
+    target.fromRawSlot = db->fromRawSlot;
+    xSemaphoreGive(dbLock);
+    return true;
+}
+
+static int compareTimes(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*) a;
+    unsigned long y = *(const unsigned long*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Looks up each of the "n" keys with a new statement for "sql" and stores
+// how long each lookup took (in microseconds, sorted) in "times"; returns
+// the number of pages read from the DB file or -1
+int Authorizer::timeLookups(sqlite3* db, const char* sql, bool binaryKeys,
+                            const byte* keys, int n, unsigned long* times) {
+    sqlite3_stmt* query;
+    if (sqlite3_prepare_v2(db, sql, -1, &query, NULL) != SQLITE_OK) {
+        log_w("Cannot benchmark DB lookups: %s", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    int misses, unused;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &unused, 1);
+
+    for (int i = 0; i < n; ++i) {
+        const byte* binHash = keys + i * HASH_SIZE;
+        char hashBuf[2 * HASH_SIZE +1];
+        hashToHex(binHash, hashBuf);
+
+        unsigned long start = micros();
+        if (binaryKeys) {
+            sqlite3_bind_blob(query, 1, binHash, HASH_SIZE, NULL);
+        } else {
+            sqlite3_bind_text(query, 1, hashBuf, 2 * HASH_SIZE, NULL);
+        }
+        while (sqlite3_step(query) == SQLITE_ROW) { }
+        sqlite3_reset(query);
+        times[i] = micros() - start;
+    }
+
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &unused, 0);
+    sqlite3_finalize(query);
+    qsort(times, n, sizeof(times[0]), compareTimes);
+    return misses;
+}
+
+// Compares the time per SQLite lookup reading the DB in use from the raw
+// DB partition (check rawdb.cpp) and from its file on FFat/SD. Each one
+// uses a new connection, so the first pass starts with an empty page
+// cache and the second one runs with the pages the first one read.
+#define DB_BENCHMARK_KEYS 64
+
+void Authorizer::benchmarkDB() {
+    static BenchmarkTarget target;
+    if (not benchmarkTarget(target)) { return; }
+
+    static byte keys[DB_BENCHMARK_KEYS * HASH_SIZE];
+    for (unsigned long i = 0; i < DB_BENCHMARK_KEYS; ++i) {
+        calculate_hash(i * 2654435761UL, keys + i * HASH_SIZE);
+    }
+
+    sqlite3* benchDB;
+    if (target.fromRawSlot) {
+        if (openRawSlot(target.slot, &benchDB) == SQLITE_OK) {
+            benchmarkLookups("raw partition", benchDB, target, keys);
+        }
+        sqlite3_close_v2(benchDB);
+    } else {
+        log_i("DB is not read from the raw DB partition");
+    }
+
+    if (sqlite3_open_v2(target.name, &benchDB, SQLITE_OPEN_READONLY, NULL)
+            == SQLITE_OK) {
+        benchmarkLookups(target.name, benchDB, target, keys);
+    }
+    sqlite3_close_v2(benchDB);
+}
+
+void Authorizer::benchmarkLookups(const char* label, sqlite3* db,
+                                  const BenchmarkTarget& target,
+                                  const byte* keys) {
+
+    static unsigned long times[DB_BENCHMARK_KEYS];
+    for (int pass = 1; pass <= 2; ++pass) {
+        int pages = timeLookups(db, target.lookupQuery, target.binaryKeys,
+                                keys, DB_BENCHMARK_KEYS, times);
+        if (pages < 0) { return; }
+
+        unsigned long elapsed = 0;
+        for (int i = 0; i < DB_BENCHMARK_KEYS; ++i) { elapsed += times[i]; }
+        log_i("DB lookups from %s, %s cache: %lu us per lookup, "
+              "%d pages read", label, pass == 1 ? "cold" : "warm",
+              elapsed / DB_BENCHMARK_KEYS, pages);
+    }
+}
+
+// Answers the questions "how large should the page cache be?" and "how
+// fast is this DB?" for the DB in use: for each mix of authorized and
+// unknown cards and each page cache size, we look up the same random
+// hashes with an empty cache and log the p50/p99 time per lookup, the
+// pages read per lookup and the peak memory used by SQLite for the
+// benchmark connection. poc_manager/dbbench.py runs the same
+// benchmark on synthetic DBs with other page sizes and numbers of users.
+#ifndef DB_BENCHMARK_LOOKUPS
+#define DB_BENCHMARK_LOOKUPS 200
+#endif
+
+static const int benchmarkCacheKB[] = { 8, 16, 32, 64 };
+static const int benchmarkHitPercent[] = { 10, 50, 90 };
+
+void Authorizer::benchmarkCache() {
+    static BenchmarkTarget target;
+    if (not benchmarkTarget(target)) { return; }
+
+    byte* authorized = (byte*) malloc(DB_BENCHMARK_LOOKUPS * HASH_SIZE);
+    byte* keys = (byte*) malloc(DB_BENCHMARK_LOOKUPS * HASH_SIZE);
+    unsigned long* times = (unsigned long*) malloc(
+                                DB_BENCHMARK_LOOKUPS * sizeof(unsigned long));
+
+    sqlite3* benchDB = NULL;
+    int numAuthorized = 0;
+    int pageSize = 0;
+    if (authorized != NULL and keys != NULL and times != NULL
+            and openBenchmarkDB(target, &benchDB)) {
+        numAuthorized = sampleAuthorized(benchDB, target.usersQuery,
+                                         authorized, DB_BENCHMARK_LOOKUPS);
+        sqlite3_stmt* query;
+        if (sqlite3_prepare_v2(benchDB, "PRAGMA page_size", -1,
+                               &query, NULL) == SQLITE_OK) {
+            if (sqlite3_step(query) == SQLITE_ROW) {
+                pageSize = sqlite3_column_int(query, 0);
+            }
+            sqlite3_finalize(query);
+        }
+    }
+    sqlite3_close_v2(benchDB);
+
+    if (pageSize == 0) {
+        log_w("Cannot benchmark the DB page cache");
+        numAuthorized = -1;
+    } else {
+        log_i("DB cache benchmark: %s, page size %d, %d lookups per test",
+              target.fromRawSlot ? "raw partition" : target.name, pageSize,
+              DB_BENCHMARK_LOOKUPS);
+    }
+
+    for (int h = 0; numAuthorized >= 0
+                    and h < sizeof(benchmarkHitPercent) / sizeof(int); ++h) {
+
+        for (int i = 0; i < DB_BENCHMARK_LOOKUPS; ++i) {
+            byte* key = keys + i * HASH_SIZE;
+            if (numAuthorized > 0
+                    and esp_random() % 100 < benchmarkHitPercent[h]) {
+                memcpy(key, authorized
+                            + esp_random() % numAuthorized * HASH_SIZE,
+                       HASH_SIZE);
+            } else {
+                esp_fill_random(key, HASH_SIZE);
+            }
+        }
+
+        for (int c = 0; c < sizeof(benchmarkCacheKB) / sizeof(int); ++c) {
+            sqlite3_int64 before = sqlite3_memory_used();
+            sqlite3_memory_highwater(1);
+            if (not openBenchmarkDB(target, &benchDB)) {
+                sqlite3_close_v2(benchDB);
+                break;
+            }
+
+            char pragma[40];
+            snprintf(pragma, sizeof(pragma), "PRAGMA cache_size=-%d",
+                     benchmarkCacheKB[c]);
+            sqlite3_exec(benchDB, pragma, NULL, NULL, NULL);
+
+            int pages = timeLookups(benchDB, target.lookupQuery,
+                                    target.binaryKeys, keys,
+                                    DB_BENCHMARK_LOOKUPS, times);
+            sqlite3_int64 peak = sqlite3_memory_highwater(0) - before;
+            sqlite3_close_v2(benchDB);
+            if (pages < 0) { break; }
+
+            log_i("Page cache %d KB, %d%% authorized: p50 %lu us, p99 %lu us,"
+                  " %d.%02d pages per lookup, SQLite peak %lld KB",
+                  benchmarkCacheKB[c], benchmarkHitPercent[h],
+                  times[DB_BENCHMARK_LOOKUPS / 2],
+                  times[DB_BENCHMARK_LOOKUPS * 99 / 100],
+                  pages / DB_BENCHMARK_LOOKUPS,
+                  pages * 100 / DB_BENCHMARK_LOOKUPS % 100, peak / 1024);
+        }
+    }
+
+    free(authorized);
+    free(keys);
+    free(times);
+}
+
+// As with sqlite3_open(), "db" should be closed even if this fails
+bool Authorizer::openBenchmarkDB(const BenchmarkTarget& target,
+                                 sqlite3** db) {
+    int rc;
+    if (target.fromRawSlot) {
+        rc = openRawSlot(target.slot, db);
+    } else {
+        rc = sqlite3_open_v2(target.name, db, SQLITE_OPEN_READONLY, NULL);
+    }
+
+    if (rc != SQLITE_OK) {
+        log_w("Cannot open the DB to benchmark it: %s", sqlite3_errstr(rc));
+        return false;
+    }
+    return true;
+}
+
+// Picks up to "max" random hashes from "usersQuery" (reservoir sampling)
+int Authorizer::sampleAuthorized(sqlite3* db, const char* usersQuery,
+                                 byte* hashes, int max) {
+    sqlite3_stmt* query;
+    if (sqlite3_prepare_v2(db, usersQuery, -1, &query, NULL) != SQLITE_OK) {
+        return 0;
+    }
+
+    int seen = 0;
+    byte binHash[HASH_SIZE];
+    while (sqlite3_step(query) == SQLITE_ROW) {
+        if (not hashFromColumn(query, 0, binHash)) { continue; }
+        int pos = seen < max ? seen : esp_random() % (seen + 1);
+        if (pos < max) { memcpy(hashes + pos * HASH_SIZE, binHash, HASH_SIZE); }
+        ++seen;
+    }
+    sqlite3_finalize(query);
+    return seen < max ? seen : max;
+}
+
+// Makes "newDB" (which may be NULL) the DB in use and returns the
+// previous one, which nobody is using anymore when this returns. Without
+// a DB, "hasSchedules" keeps the value of the last one: the flat index
+// (which matches that DB) may still be in use and must not admit users
+// with a schedule at any time.
+inline AuthDB* Authorizer::switchDB(AuthDB* newDB) {
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    AuthDB* oldDB = activeDB;
+    activeDB = newDB;
+    if (newDB != NULL) { hasSchedules = newDB->hasSchedules; }
+    ++dbGeneration;
+    cache.clear();
+    xSemaphoreGive(dbLock);
+    return oldDB;
+}
+
+inline void Authorizer::closeDB() {
+    if (dbLock == NULL) { return; } // never opened
+#   if DB_SHARDS > 1
+    for (int shard = 0; shard < DB_SHARDS; ++shard) { closeDB(shard); }
+#   endif
+    AuthDB* oldDB = switchDB(NULL);
+    if (oldDB != NULL) { oldDB->close(); }
+    loadSnapshot();
+}
+
+inline void Authorizer::closeDB(int shard) {
+#   if DB_SHARDS > 1
+    if (dbLock == NULL) { return; } // never opened
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    for (int i = 0; i < DB_SHARDS_OPEN; ++i) {
+        if (shardDBs[i].shard == shard) { shardDBs[i].close(); }
+    }
+    shardFiles[shard][0] = 0;
+    cache.clear();
+    xSemaphoreGive(dbLock);
+#   else
+    closeDB();
+#   endif
 }
 
 // The sqlite3 docs say "The C parameter to sqlite3_close(C) and
 // sqlite3_close_v2(C) must be either a NULL pointer or an sqlite3
 // object pointer [...] and not previously closed". So, we always
 // make it NULL here to avoid closing a pointer previously closed.
-inline void Authorizer::closeDB() {
+void AuthDB::close() {
+    index.clear();
+    prefixIndex.clear();
+    bloom.clear();
+    schedules.clear();
+    version = 0;
+    fromRawSlot = false;
+    shard = -1;
+    lastUse = 0;
     sqlite3_finalize(dbquery);
     dbquery = NULL;
     sqlite3_close_v2(sqlitedb);
     sqlitedb = NULL;
 }
 
-inline void Authorizer::refreshQuery() { sqlite3_reset(dbquery); }
+void Authorizer::logStats() {
+    AuthDB* db = activeDB;
+    bool noDB = db == NULL;
+    log_i("Authorizer stats: in-RAM index %s, prefix index %s, "
+          "Bloom filter %s; %u filter queries, %u rejected, "
+          "%u false positives; %u decision cache hits, %u misses",
+          not noDB and db->index.available() ? "active" : "inactive",
+          not noDB and db->prefixIndex.available() ? "active" : "inactive",
+          not noDB and db->bloom.available() ? "active" : "inactive",
+          filterQueries, filterRejected, filterFalsePositives,
+          cacheHits, cacheMisses);
+}
+
+// This is called during startup and after the flat index is updated
+void Authorizer::openFlatIndex() {
+    cache.clear();
+    if (not flatIndex.open()) { return; }
+
+    if (dbLock == NULL) { // no DB yet
+        useLastDB();
+        return;
+    }
+
+#   if DB_SHARDS > 1
+    flatIndexMatches(shardsVersion);
+    return;
+#   endif
+
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    AuthDB* db = activeDB;
+    if (db == NULL) {
+        useLastDB();
+    } else if (flatIndexMatches(db->version)) {
+        // No need to waste memory with these anymore
+        db->index.clear();
+        db->prefixIndex.clear();
+        db->bloom.clear();
+    }
+    xSemaphoreGive(dbLock);
+}
+
+/*
+  The flat index does not depend on the disk, so we use it right after
+  booting, before the DB is opened, and also if the disk fails. Then,
+  there is no DB to tell us whether the index is current (if it is from
+  an older version, it still has cards revoked since then) or whether
+  there are schedules (if there are, a user with one would get in at any
+  time). So, every time we activate a DB, we save its version and
+  whether it has schedules in NVS (only if they changed) and, while there
+  is no DB, we only use the flat index if it matches that version. If we
+  know nothing about the last DB, we do not use the flat index at all.
+*/
+void Authorizer::saveLastDB(unsigned int version, bool withSchedules) {
+    LastDBRecord record = {};
+    record.version = version;
+    record.hasSchedules = withSchedules;
+    if (lastDBKnown and 0 == memcmp(&record, &lastDB, sizeof(record))) {
+        return;
+    }
+    lastDB = record;
+    lastDBKnown = true;
+
+    nvs_handle_t nvsHandle;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvsHandle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvsHandle, LAST_DB_NVS_KEY, &record,
+                           sizeof(record));
+        if (err == ESP_OK) { err = nvs_commit(nvsHandle); }
+        nvs_close(nvsHandle);
+    }
+
+    if (err != ESP_OK) {
+        log_w("Error (%s) saving the DB version", esp_err_to_name(err));
+    }
+}
+
+// Must be called without a DB (and with "dbLock" held, if it exists)
+void Authorizer::useLastDB() {
+    if (not lastDBKnown) {
+        nvs_handle_t nvsHandle;
+        if (nvs_open("storage", NVS_READONLY, &nvsHandle) == ESP_OK) {
+            size_t size = sizeof(lastDB);
+            lastDBKnown = ESP_OK == nvs_get_blob(nvsHandle, LAST_DB_NVS_KEY,
+                                                 &lastDB, &size)
+                          and size == sizeof(lastDB);
+            nvs_close(nvsHandle);
+        }
+    }
+
+    if (not lastDBKnown) {
+        log_i("Last DB version unknown, ignoring the flat index");
+        flatIndex.close();
+        return;
+    }
+
+    hasSchedules = lastDB.hasSchedules;
+    flatIndexMatches(lastDB.version);
+}
+
+// This is called during startup and whenever the DB is closed; with
+// DB_SHARDS > 1 there is no single DB to take the snapshot from.
+void Authorizer::loadSnapshot() {
+#   if DB_SHARDS == 1
+    snapshot.load();
+#   endif
+}
+
+// The DB may be updated with deltas (check dbmanager.cpp) and the flat
+// index may arrive before or after the DB is updated. Until both refer
+// to the same version, we ignore the flat index and use the DB.
+bool Authorizer::flatIndexMatches(unsigned int version) {
+    if (not flatIndex.available()) { return false; }
+    if (flatIndex.version() == version) { return true; }
+
+    log_i("Flat index is for DB version %u, but the DB is version %u; "
+          "ignoring it", flatIndex.version(), version);
+    flatIndex.close();
+    return false;
+}
+
+// With DB_SHARDS > 1, the DB manager calls this with the version all the
+// shards are at, from the shard manifest, or 0 while some of them are
+// outdated; this plays the role of openDB() for the flat index.
+void Authorizer::setShardsVersion(unsigned int version) {
+    shardsVersion = version;
+    cache.clear();
+    if (not flatIndex.available()) { flatIndex.open(); }
+    flatIndexMatches(version);
+    saveLastDB(version, hasSchedules);
+}
+
+// When a delta only changes the version of the DB (check
+// UpdateDBManager::bumpVersion()), the DB manager tells us that the DB
+// file at "fileVersion" is at "version" from now on (0 if this no longer
+// applies), so we can use the flat index generated from that version.
+void Authorizer::aliasDBVersion(unsigned int fileVersion,
+                                unsigned int version) {
+
+    aliasedFileVersion = fileVersion;
+    aliasedVersion = version;
+
+#   if DB_SHARDS > 1
+    return;
+#   endif
+
+    if (dbLock == NULL or version == 0) { return; } // openDB() does it
+
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    AuthDB* db = activeDB;
+    if (db != NULL) { db->version = version; }
+    bool withSchedules = hasSchedules;
+    xSemaphoreGive(dbLock);
+    if (db == NULL) { return; }
+
+    log_i("DB version is now %u", version);
+    openFlatIndex();
+    saveLastDB(version, withSchedules);
+}
+
+/*
+  Right after a DB is opened, the SQLite page cache is empty, so the
+  first cards need several disk reads each. If we are going to query
+  SQLite for every card (i.e., there is neither an in-RAM index nor a
+  flat index), a low-priority task "warms up" the cache: it looks up the
+  last cards read (they are likely to be read again) and then
+  AUTH_WARMUP_PROBES hashes evenly spread over the key space, which
+  loads the interior pages of the "auth" index and some of its leaves.
+  It stops after AUTH_WARMUP_MAX_MS, when the cache grows by
+  AUTH_WARMUP_MAX_BYTES or when the DB changes. Each lookup holds
+  "dbLock", just like userAuthorized(), so a card read waits for at most
+  one of them, and the task yields the CPU between lookups.
+*/
+static StaticTask_t warmUpTaskBuffer;
+static StackType_t warmUpTaskStack[6144];
+
+static void warmUpLoop(void* params) {
+    Authorizer* authorizer = (Authorizer*) params;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        authorizer->warmUp();
+    }
+}
+
+void Authorizer::startWarmUp() {
+    if (AUTH_WARMUP_PROBES == 0) { return; }
+
+    if (warmUpTask == NULL) {
+        warmUpTask = xTaskCreateStaticPinnedToCore(
+                                    warmUpLoop,
+                                    "warmUpTask",
+                                    sizeof(warmUpTaskStack),
+                                    this,
+                                    tskIDLE_PRIORITY + 1, // below everybody
+                                    warmUpTaskStack,
+                                    &warmUpTaskBuffer,
+                                    0); // the main loop runs on core 1
+    }
+
+    xTaskNotifyGive(warmUpTask);
+}
+
+void Authorizer::warmUp() {
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    AuthDB* db = activeDB;
+    uint32_t generation = dbGeneration;
+    sqlite3_stmt* query = NULL;
+    bool binaryKeys = false;
+    int cacheUsed = 0, highwater;
+    if (db != NULL and not db->index.available()
+            and not (flatIndex.available()
+                     and flatIndex.version() == db->version)) {
+
+        // Our own statement, so we do not interfere with userAuthorized()
+        sqlite3_prepare_v2(db->sqlitedb, sqlite3_sql(db->dbquery), -1,
+                           &query, NULL);
+        binaryKeys = db->binaryKeys;
+        sqlite3_db_status(db->sqlitedb, SQLITE_DBSTATUS_CACHE_USED,
+                          &cacheUsed, &highwater, 0);
+    }
+    xSemaphoreGive(dbLock);
+
+    if (query == NULL) { return; }
+
+    // Building the prefix index or the Bloom filter reads the whole
+    // table, so the cache may already be full (of leaf pages); in that
+    // case, we replace them instead of using more memory.
+    unsigned long start = millis();
+    int maxCacheUsed = cacheUsed + AUTH_WARMUP_MAX_BYTES;
+    int lookups = 0;
+    bool ok = true;
+
+    static char recent[DECISION_CACHE_SIZE][65];
+    int n = cache.recentHashes(recent);
+    byte binHash[HASH_SIZE];
+    for (int i = 0; ok and i < n; ++i) {
+        if (not hashFromHex(recent[i], binHash)) { continue; }
+        ok = warmUpKey(query, binHash, binaryKeys, generation, start,
+                       maxCacheUsed);
+        ++lookups;
+    }
+
+    memset(binHash, 0, sizeof(binHash));
+    for (uint32_t i = 0; ok and i < AUTH_WARMUP_PROBES; ++i) {
+        uint32_t prefix = i * 65536 / AUTH_WARMUP_PROBES;
+        binHash[0] = prefix >> 8;
+        binHash[1] = prefix & 0xff;
+        ok = warmUpKey(query, binHash, binaryKeys, generation, start,
+                       maxCacheUsed);
+        ++lookups;
+    }
+
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    if (dbGeneration == generation) {
+        sqlite3_db_status(db->sqlitedb, SQLITE_DBSTATUS_CACHE_USED,
+                          &cacheUsed, &highwater, 0);
+    }
+    sqlite3_finalize(query);
+    xSemaphoreGive(dbLock);
+
+    log_i("DB cache warm-up: %d lookups in %lu ms, %d KB of cache",
+          lookups, millis() - start, cacheUsed / 1024);
+}
+
+// Returns false if we should stop
+bool Authorizer::warmUpKey(sqlite3_stmt* query, const byte* binHash,
+                           bool binaryKeys, uint32_t generation,
+                           unsigned long start, int maxCacheUsed) {
+
+    if (millis() - start >= AUTH_WARMUP_MAX_MS) { return false; }
+
+    char hashBuf[2 * HASH_SIZE +1];
+    if (not binaryKeys) { hashToHex(binHash, hashBuf); }
+
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    bool ok = dbGeneration == generation;
+    if (ok) {
+        if (binaryKeys) {
+            sqlite3_bind_blob(query, 1, binHash, HASH_SIZE, NULL);
+        } else {
+            sqlite3_bind_text(query, 1, hashBuf, 2 * HASH_SIZE, NULL);
+        }
+        while (sqlite3_step(query) == SQLITE_ROW) { }
+        sqlite3_reset(query);
+
+        int cacheUsed, highwater;
+        sqlite3_db_status(sqlite3_db_handle(query), SQLITE_DBSTATUS_CACHE_USED,
+                          &cacheUsed, &highwater, 0);
+        ok = cacheUsed < maxCacheUsed;
+    }
+    xSemaphoreGive(dbLock);
+
+    vTaskDelay(1);
+    return ok;
+}
+
+unsigned int AuthDB::readVersion() {
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(sqlitedb, "PRAGMA user_version",
+                                -1, &query, NULL);
+    if (rc != SQLITE_OK) { return 0; }
+
+    unsigned int version = 0;
+    if (sqlite3_step(query) == SQLITE_ROW) {
+        version = sqlite3_column_int(query, 0);
+    }
+    sqlite3_finalize(query);
+
+    return version;
+}
+
+// This is called before the flat index is updated; until we reopen
+// it (or open a new DB), we query SQLite.
+void Authorizer::closeFlatIndex() {
+    cache.clear();
+    flatIndex.close();
+}
+
+inline void Authorizer::refreshQuery() {
+    if (dbLock == NULL) { return; }
+    xSemaphoreTake(dbLock, portMAX_DELAY);
+    if (activeDB != NULL) { sqlite3_reset(activeDB->dbquery); }
+#   if DB_SHARDS > 1
+    for (int i = 0; i < DB_SHARDS_OPEN; ++i) {
+        sqlite3_reset(shardDBs[i].dbquery); // harmless if NULL
+    }
+#   endif
+    xSemaphoreGive(dbLock);
+}
+
+inline unsigned int Authorizer::currentDBVersion() {
+    AuthDB* db = activeDB;
+    return db == NULL ? 0 : db->version;
+}
 
 Authorizer authorizer;
 
 
-int openDB(const char* filename) { return authorizer.openDB(filename); }
+int openDB(const char* filename, int shard) {
+    return authorizer.openDB(filename, shard);
+}
 
 void closeDB() { authorizer.closeDB(); }
 
-bool userAuthorized(const char* readerID, const char* cardHash) {
-    return authorizer.userAuthorized(readerID, cardHash);
+void closeDB(int shard) { authorizer.closeDB(shard); }
+
+void openFlatIndex() { authorizer.openFlatIndex(); }
+
+void closeFlatIndex() { authorizer.closeFlatIndex(); }
+
+void setDBShardsVersion(unsigned int version) {
+    authorizer.setShardsVersion(version);
+}
+
+void loadAuthSnapshot() { authorizer.loadSnapshot(); }
+
+bool userAuthorized(const char* readerID, const byte* binHash,
+                    const char* cardHash) {
+    return authorizer.userAuthorized(readerID, binHash, cardHash);
+}
+
+bool cardAuthorized(const char* readerID, unsigned long cardID,
+                    char* hashBuf) {
+    return authorizer.cardAuthorized(readerID, cardID, hashBuf);
 }
 
-void calculate_hash(unsigned long cardID, char* hashBuf) {
-    authorizer.calculate_hash(cardID, hashBuf);
+void calculate_hash(unsigned long cardID, byte* binHash) {
+    authorizer.calculate_hash(cardID, binHash);
+}
+
+void hashToHex(const byte* binHash, char* hashBuf) {
+    authorizer.hashToHex(binHash, hashBuf);
 }
 
 void refreshQuery() { authorizer.refreshQuery(); }
+
+void logAuthStats() { authorizer.logStats(); }
+
+void benchmarkHash() { authorizer.benchmarkHash(); }
+
+void benchmarkDB() { authorizer.benchmarkDB(); }
+
+void benchmarkDBCache() { authorizer.benchmarkCache(); }
+
+unsigned int currentDBVersion() { return authorizer.currentDBVersion(); }
+
+void aliasDBVersion(unsigned int fileVersion, unsigned int version) {
+    authorizer.aliasDBVersion(fileVersion, version);
+}
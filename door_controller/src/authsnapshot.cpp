@@ -0,0 +1,316 @@
+static const char *TAG = "authsnap";
+
+#include <tramela.h>
+#include <Arduino.h>
+#include <sqlite3.h>
+#include <esp_partition.h>
+#include <esp_crc.h>
+#include <authsnapshot.h>
+#include <authindex.h> // hashFromColumn(), HASH_SIZE
+#include <schedules.h> // NO_SCHEDULE, scheduleFromColumn()
+
+/*
+  If the DB cannot be opened (the disk did not mount, the file is
+  corrupted and we are downloading it again etc.) and there is no flat
+  index, only the master keys would work. To avoid this, every time a DB
+  is activated we save the users authorized for this door in flash,
+  which does not depend on the disk, and while there is no DB we check them
+  with a binary search in RAM, so they still get in as fast as usual.
+
+  Like the prefix index (check authindex.cpp), we keep only the first 64
+  bits of each hash: with AUTH_SNAPSHOT_MAX_USERS 4000, the snapshot
+  takes 32KB. That is too much for NVS, which is small and holds the
+  other records of the DB manager, so the snapshot has its own partition
+  ("authsnap", check min_ffat.csv), split in two slots: we write the new
+  snapshot to the slot not in use, with its header last, so if we are
+  interrupted the previous one is still valid. Unlike the prefix index,
+  there is no SQLite to confirm a match, but the chance that an unknown
+  card matches one of the prefixes is about count / 2^64.
+
+  We cannot check schedules without the DB, so users with a schedule are
+  left out. The snapshot is only rewritten when the set of users changes
+  (flash sectors have limited endurance) and, if it is damaged or was
+  saved for another door, we simply ignore it.
+*/
+
+static inline const esp_partition_t* snapshotPartition() {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                    ESP_PARTITION_SUBTYPE_ANY,
+                                    AUTH_SNAPSHOT_PARTITION);
+}
+
+static inline size_t slotSize(const esp_partition_t* partition) {
+    return partition->size / 2 / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+}
+
+// The most users that fit in a slot of the partition
+static inline size_t maxUsers(const esp_partition_t* partition) {
+    size_t fit = (slotSize(partition) - sizeof(AuthSnapshotHeader))
+                 / sizeof(uint64_t);
+    return fit < AUTH_SNAPSHOT_MAX_USERS ? fit : AUTH_SNAPSHOT_MAX_USERS;
+}
+
+// The byte order does not matter, as long as we always use the same
+static inline uint64_t snapshotPrefix(const uint8_t* binHash) {
+    uint64_t prefix;
+    memcpy(&prefix, binHash, sizeof(prefix));
+    return prefix;
+}
+
+static int compareSnapshotPrefixes(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void AuthSnapshot::save(sqlite3* db, const char* usersQuery,
+                        bool withSchedules) {
+
+    const esp_partition_t* partition = snapshotPartition();
+    if (partition == NULL) {
+        log_w("No authorization snapshot partition available");
+        return;
+    }
+
+    unsigned long start = millis();
+
+    // One more than the maximum, so we know when there are too many
+    size_t max = maxUsers(partition) + 1;
+    uint64_t* data = (uint64_t*) malloc(max * sizeof(uint64_t));
+    if (data == NULL) {
+        log_w("Could not allocate the authorization snapshot");
+        return;
+    }
+
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(db, usersQuery, -1, &query, NULL);
+    if (rc != SQLITE_OK) {
+        log_w("Cannot read authorized users: %s", sqlite3_errmsg(db));
+        free(data);
+        return;
+    }
+
+    size_t n = 0;
+    rc = sqlite3_step(query);
+    while (rc == SQLITE_ROW and n < max) {
+        byte binHash[HASH_SIZE];
+        uint16_t scheduleID;
+        bool unrestricted = not withSchedules
+                            or (scheduleFromColumn(query, 1, scheduleID)
+                                and scheduleID == NO_SCHEDULE);
+        if (unrestricted and hashFromColumn(query, 0, binHash)) {
+            data[n++] = snapshotPrefix(binHash);
+        }
+        rc = sqlite3_step(query);
+    }
+    sqlite3_finalize(query);
+
+    if (n >= max) {
+        log_w("Too many authorized users for the snapshot (more than %u), "
+              "removing it", max - 1);
+        free(data);
+        erase();
+        return;
+    }
+
+    // A missing user would be denied access during a recovery
+    if (rc != SQLITE_DONE) {
+        log_w("Error reading authorized users: %s", sqlite3_errmsg(db));
+        free(data);
+        return;
+    }
+
+    qsort(data, n, sizeof(uint64_t), compareSnapshotPrefixes);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (unique > 0 and data[unique -1] == data[i]) { continue; }
+        data[unique++] = data[i];
+    }
+
+    AuthSnapshotHeader header;
+    memcpy(header.magic, AUTH_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.doorID = doorID;
+    header.count = unique;
+    header.crc = esp_crc32_le(0, (const uint8_t*) data,
+                              unique * sizeof(uint64_t));
+
+    AuthSnapshotHeader oldHeader;
+    uint64_t* oldData = NULL;
+    int slot = -1;
+    bool unchanged = read(oldHeader, oldData, slot)
+                     and oldHeader.count == header.count
+                     and oldHeader.crc == header.crc
+                     and 0 == memcmp(oldData, data, unique * sizeof(uint64_t));
+    free(oldData);
+
+    if (unchanged) {
+        log_d("Authorization snapshot did not change");
+        free(data);
+        return;
+    }
+
+    header.sequence = slot < 0 ? 1 : oldHeader.sequence + 1;
+    bool ok = write(slot == 0 ? 1 : 0, header, data);
+    free(data);
+    if (not ok) { return; }
+
+    log_i("Authorization snapshot saved: %u users for door %d, "
+          "%u bytes, %lu ms", unique, doorID,
+          sizeof(header) + unique * sizeof(uint64_t), millis() - start);
+}
+
+// Writes the snapshot to the given slot: the prefixes first and the
+// header last, so the slot is only valid if everything was written
+bool AuthSnapshot::write(int slot, AuthSnapshotHeader& header,
+                         const uint64_t* data) {
+
+    const esp_partition_t* partition = snapshotPartition();
+    size_t offset = slot * slotSize(partition);
+    size_t bytes = header.count * sizeof(uint64_t);
+    size_t toErase = (sizeof(header) + bytes + SPI_FLASH_SEC_SIZE - 1)
+                        / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+
+    esp_err_t err = esp_partition_erase_range(partition, offset, toErase);
+    if (err == ESP_OK and bytes > 0) {
+        err = esp_partition_write(partition, offset + sizeof(header),
+                                  data, bytes);
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition, offset, &header, sizeof(header));
+    }
+
+    if (err != ESP_OK) {
+        log_w("Error (%s) saving the authorization snapshot",
+              esp_err_to_name(err));
+        return false;
+    }
+
+    return true;
+}
+
+// Reads and validates the current snapshot and tells us its slot (-1 if
+// there is none); "data" must be freed
+bool AuthSnapshot::read(AuthSnapshotHeader& header, uint64_t*& data,
+                        int& slot) {
+
+    data = NULL;
+    slot = -1;
+
+    const esp_partition_t* partition = snapshotPartition();
+    if (partition == NULL) { return false; }
+
+    for (int i = 0; i < 2; ++i) {
+        AuthSnapshotHeader h;
+        if (esp_partition_read(partition, i * slotSize(partition),
+                               &h, sizeof(h)) != ESP_OK) {
+            continue;
+        }
+        bool valid = 0 == memcmp(h.magic, AUTH_SNAPSHOT_MAGIC,
+                                 sizeof(h.magic))
+                     and h.count <= maxUsers(partition);
+        if (valid and (slot < 0 or h.sequence > header.sequence)) {
+            header = h;
+            slot = i;
+        }
+    }
+    if (slot < 0) { return false; }
+
+    // The sequence continues from any slot, even if it is for another door
+    size_t bytes = header.count * sizeof(uint64_t);
+    if (header.doorID != doorID) { return false; }
+
+    data = (uint64_t*) malloc(bytes > 0 ? bytes : 1);
+    if (data == NULL) { return false; }
+
+    bool ok = esp_partition_read(partition,
+                                 slot * slotSize(partition) + sizeof(header),
+                                 data, bytes) == ESP_OK
+              and header.crc == esp_crc32_le(0, (const uint8_t*) data,
+                                             bytes);
+    if (not ok) {
+        free(data);
+        data = NULL;
+    }
+    return ok;
+}
+
+// Erasing the first sector of each slot invalidates both
+void AuthSnapshot::erase() {
+    const esp_partition_t* partition = snapshotPartition();
+    if (partition == NULL) { return; }
+
+    for (int i = 0; i < 2; ++i) {
+        AuthSnapshotHeader h;
+        esp_partition_read(partition, i * slotSize(partition),
+                           &h, sizeof(h));
+        if (0 == memcmp(h.magic, AUTH_SNAPSHOT_MAGIC, sizeof(h.magic))) {
+            esp_partition_erase_range(partition, i * slotSize(partition),
+                                      SPI_FLASH_SEC_SIZE);
+        }
+    }
+}
+
+// This is called when there is no DB (during startup, until a DB is
+// opened, and whenever the DB is closed)
+bool AuthSnapshot::load() {
+    if (lock == NULL) { lock = xSemaphoreCreateMutex(); }
+
+    AuthSnapshotHeader header;
+    uint64_t* data;
+    int slot;
+    bool ok = read(header, data, slot);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint64_t* old = prefixes;
+    prefixes = data;
+    count = ok ? header.count : 0;
+    xSemaphoreGive(lock);
+    free(old);
+
+    if (ok) {
+        log_i("Using the authorization snapshot (%u users) until "
+              "a DB is available", count);
+    } else {
+        log_d("No valid authorization snapshot");
+    }
+    return ok;
+}
+
+// The DB is available again, so we do not need this in RAM anymore
+void AuthSnapshot::clear() {
+    if (lock == NULL) { return; } // never loaded
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint64_t* old = prefixes;
+    prefixes = NULL;
+    count = 0;
+    xSemaphoreGive(lock);
+    free(old);
+}
+
+bool AuthSnapshot::contains(const uint8_t* binHash) {
+    if (lock == NULL) { return false; }
+
+    uint64_t prefix = snapshotPrefix(binHash);
+    bool found = false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    size_t low = 0;
+    size_t high = prefixes == NULL ? 0 : count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (prefixes[mid] == prefix) {
+            found = true;
+            break;
+        }
+        if (prefixes[mid] < prefix) {
+            low = mid +1;
+        } else {
+            high = mid;
+        }
+    }
+    xSemaphoreGive(lock);
+
+    return found;
+}
@@ -0,0 +1,38 @@
+#include <cardhash.h>
+#include <sha256compat.h>
+
+// Same as HASH_SIZE (authindex.h), which we cannot include without Arduino
+#define CARD_HASH_SIZE 32
+
+/*
+  The hashes in the DB are calculated from the card ID as a 10-char,
+  right-aligned, space-padded decimal string (what sprintf("%10lu")
+  produces), so we keep exactly this format. Card IDs have at most 32
+  bits, so they always fit in 10 digits. On the ESP32, mbedtls uses the
+  SHA hardware accelerator, and the one-shot call avoids the generic
+  mbedtls_md context and its heap allocation.
+
+  This file does not depend on Arduino, so the unit tests in test/native
+  check it on the host against the old sprintf() and mbedtls_md code.
+*/
+void cardHash(unsigned long cardID, uint8_t* binHash) {
+    unsigned char buf[10];
+    int i = 9;
+    do {
+        buf[i--] = '0' + cardID % 10;
+        cardID /= 10;
+    } while (cardID > 0 and i >= 0);
+    while (i >= 0) { buf[i--] = ' '; }
+
+    sha256(buf, 10, binHash);
+}
+
+// We only need this for the logs, the master keys and schema v1 DBs
+void cardHashToHex(const uint8_t* binHash, char* hashBuf) {
+    static const char hexDigits[] = "0123456789abcdef";
+    for (int i = 0; i < CARD_HASH_SIZE; ++i) {
+        hashBuf[2*i] = hexDigits[binHash[i] >> 4];
+        hashBuf[2*i +1] = hexDigits[binHash[i] & 0x0f];
+    }
+    hashBuf[2 * CARD_HASH_SIZE] = 0;
+}
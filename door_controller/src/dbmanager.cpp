@@ -11,12 +11,167 @@ static const char *TAG = "dbman";
 #include "FFat.h"
 #endif
 
-#include <sqlite3.h> // Just to check for SQLITE_OK
+#include <sqlite3.h> // To check for SQLITE_OK and apply DB deltas
+#include <esp_partition.h>
+#include <esp_crc.h>
+#include <esp32/rom/miniz.h> // tinfl, in ROM
+#include <sha256compat.h>
+#include <nvs.h>
+#include <sys/stat.h>
+#include <unistd.h> // truncate()
 
 #include <dbmanager.h>
 #include <authorizer.h> // Notify that the DB changed with openDB/closeDB
+#include <authindex.h> // HASH_SIZE
+#include <flatindex.h>
 #include <mqttmanager.h> // We may need to call "forceDBDownload"
 
+// Larger deltas are ignored and we download the full DB instead
+#ifndef DB_DELTA_MAX_SIZE
+#define DB_DELTA_MAX_SIZE 16384
+#endif
+
+// Compressed DB downloads are inflated through a circular buffer of
+// this size, so the server must not use a larger deflate window
+#ifndef DB_INFLATE_WINDOW_BITS
+#define DB_INFLATE_WINDOW_BITS 12
+#endif
+#define DB_INFLATE_WINDOW_SIZE (1 << DB_INFLATE_WINDOW_BITS)
+
+#define DB_DIGEST_MAGIC "TRAMDB01"
+
+// The server puts this header before the (possibly compressed) DB
+typedef struct {
+    char magic[8];             // DB_DIGEST_MAGIC, not NULL-terminated
+    uint8_t digest[HASH_SIZE]; // SHA-256 of the DB file
+} DBDigestHeader;
+
+#define DB_PATCH_MAGIC "TRAMDIF1"
+
+// Header of a binary patch (check writeToPatch below); little-endian
+typedef struct {
+    char magic[8];         // DB_PATCH_MAGIC, not NULL-terminated
+    uint32_t baseVersion;
+    uint32_t targetVersion;
+    uint32_t targetSize;   // size of the resulting DB file
+    uint32_t targetCRC;    // CRC32 of the resulting DB file
+} DBPatchHeader;
+
+#define DB_CHUNK_MAGIC "TRAMCHK1"
+
+// If a chunk fails this many times in a row, the copy in the broker is
+// probably broken, so we give up (until the next full DB download)
+#ifndef DB_CHUNK_MAX_RETRIES
+#define DB_CHUNK_MAX_RETRIES 3
+#endif
+
+// Header of each chunk of the DB (check writeToDBChunk below)
+typedef struct {
+    char magic[8];             // DB_CHUNK_MAGIC, not NULL-terminated
+    uint8_t digest[HASH_SIZE]; // SHA-256 of the whole DB file
+    uint32_t index;            // of this chunk, starting at 0
+    uint32_t count;            // number of chunks
+    uint32_t offset;           // of this chunk in the DB file
+    uint32_t size;             // of this chunk, uncompressed
+    uint32_t crc;              // CRC32 of this chunk, uncompressed
+} DBChunkHeader;
+
+// Digest of the current DB file when it was at this version; saved in
+// NVS, so we do not need to read the whole file on every boot
+typedef struct {
+    uint32_t version; // 0 if unknown
+    uint8_t digest[HASH_SIZE];
+    uint32_t fromDelta; // 1 if a SQL delta took it to this version
+} DBDigestRecord;
+
+// The version the current DB file is at, if an empty delta changed it
+// (check UpdateDBManager::bumpVersion()); saved in NVS
+typedef struct {
+    uint32_t fileVersion; // its "PRAGMA user_version"
+    uint32_t version;     // 0 if this does not apply
+} DBVersionRecord;
+
+// How far we got with a chunked download; saved in NVS
+typedef struct {
+    uint8_t digest[HASH_SIZE]; // of the DB we are downloading
+    uint32_t nextChunk;        // 0 if there is no download in progress
+    uint32_t count;
+    uint32_t nextOffset;
+} DBChunkCursor;
+
+// Which of the two DB files is the current one and which of them hold
+// a complete DB; saved in NVS as a single record (one entry per shard),
+// so it changes atomically
+typedef struct {
+    uint8_t current; // 0 (DB_A) or 1 (DB_B)
+    uint8_t valid;   // bit i is set if file i is valid
+} DBSlots;
+
+// With DB_SHARDS > 1, the server publishes this manifest, followed by the
+// SHA-256 of each shard, on "/topic/dbshardmanifest" (check
+// checkShardManifest() below); little-endian
+#define DB_SHARD_MANIFEST_MAGIC "TRAMSHM2"
+
+typedef struct {
+    char magic[8];    // DB_SHARD_MANIFEST_MAGIC, not NULL-terminated
+    uint32_t shards;  // must be DB_SHARDS
+    uint32_t version; // of the DB the shards come from
+} DBShardManifestHeader;
+
+// "/DB_A.db" and "/DB_B.db" or, with DB_SHARDS > 1, "/DB_A0.db",
+// "/DB_B0.db", "/DB_A1.db" etc.
+static void dbFileName(int shard, int slot, char* name, size_t size) {
+    if (DB_SHARDS > 1) {
+        snprintf(name, size, "/DB_%c%d.db", 'A' + slot, shard);
+    } else {
+        snprintf(name, size, "/DB_%c.db", 'A' + slot);
+    }
+}
+
+// Builds the VFS path of a file on the disk ("/ffat/DB_A.db" etc.)
+static void diskPath(const char* filename, char* path, size_t size) {
+#   ifdef USE_SD
+    snprintf(path, size, "/sd%s", filename);
+#   else
+    snprintf(path, size, "/ffat%s", filename);
+#   endif
+}
+
+// Small records we keep in NVS; "data" is zeroed if there is none
+static bool loadNVSBlob(const char* key, void* data, size_t size) {
+    memset(data, 0, size);
+
+    nvs_handle_t nvsHandle;
+    if (nvs_open("storage", NVS_READONLY, &nvsHandle) != ESP_OK) {
+        return false;
+    }
+
+    size_t found = size;
+    esp_err_t err = nvs_get_blob(nvsHandle, key, data, &found);
+    bool ok = err == ESP_OK and found == size;
+    if (not ok) { memset(data, 0, size); }
+
+    nvs_close(nvsHandle);
+    return ok;
+}
+
+static void saveNVSBlob(const char* key, const void* data, size_t size) {
+    nvs_handle_t nvsHandle;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvsHandle);
+    if (err != ESP_OK) {
+        log_w("Error (%s) opening NVS handle", esp_err_to_name(err));
+        return;
+    }
+
+    err = nvs_set_blob(nvsHandle, key, data, size);
+    if (err == ESP_OK) { err = nvs_commit(nvsHandle); }
+    if (err != ESP_OK) {
+        log_w("Error (%s) saving %s to NVS", esp_err_to_name(err), key);
+    }
+
+    nvs_close(nvsHandle);
+}
+
 namespace DBNS {
 
     // We should continue working normally even when we are downloading
@@ -24,11 +179,23 @@ namespace DBNS {
     // with predefined filenames ("DB_A" and "DB_B"): one is the current
     // DB file and the other is a temporary file (either the previous
     // file in use or the file we are currently downloading). When
-    // downloading finishes, we swap them, i.e., we call closeDB/openDB
-    // to notify the Authorizer that the current DB has changed. So,
+    // downloading finishes, we swap them, i.e., we call openDB to make
+    // the Authorizer switch to the new file (it keeps using the old one
+    // until the new one is ready, check authorizer.cpp). So,
     // sometimes the current DB file is "DB_A", sometimes it is "DB_B".
-    // During startup, we choose which of the files is the current one
-    // by means of the "status" files.
+    // Which one is current and which ones are valid (completely
+    // downloaded) is a single record in NVS ("dbslots"); NVS writes are
+    // atomic, so if we crash during a swap we end up with either the old
+    // or the new state, never a mix of both. Older versions kept this in
+    // six small "status" files (VALID_A.TXT etc.); we convert them once.
+    //
+    // With DB_SHARDS > 1, each shard (check authorizer.h) has its own
+    // pair of files and its own entry in "dbslots", and the methods below
+    // work on the shard chosen with selectShard(). Shards are always
+    // downloaded whole (a few of them when some users change, instead of
+    // the whole DB), so there are no deltas, patches or chunks; we keep
+    // the SHA-256 of each current shard in NVS ("sharddigests") to find
+    // out which ones changed (check checkShardManifest()).
 
     class UpdateDBManager {
     public:
@@ -39,46 +206,180 @@ namespace DBNS {
         inline void finishDBDownload(); // Close downloaded file, swap DB file
         inline void cancelDBDownload();
 
+        inline ssize_t writeToDBDelta(const char* data, int data_len);
+        inline void finishDBDelta(); // Apply the delta to the current DB
+        inline void cancelDBDelta();
+
+        inline ssize_t writeToDBChunk(const char* data, int data_len);
+        inline bool finishDBChunk(); // false if we need another chunk
+        inline void cancelDBChunk();
+        inline unsigned int nextDBChunk() { return cursor.nextChunk; };
+
+        inline bool checkDBManifest(const char* data, int data_len);
+
+        inline void selectShard(int shard);
+        inline uint32_t checkShardManifest(const char* data, int data_len);
+
+        inline bool wipeFiles(); // Remove all DB files and what we know
+
     private:
         bool diskOK = false;
         bool downloading;
-        const char *currentFile;
-        const char *otherFile;
+        char currentFile[16];
+        char otherFile[16];
+
+        // "slots" is the entry of "shard" in "allSlots"
+        int shard = 0;
+        DBSlots slots;
+        DBSlots allSlots[DB_SHARDS];
+        inline void setFileNames();
+        inline void loadSlots();
+        inline void saveSlots();
+        inline void setValid(uint8_t slot, bool valid);
+        inline bool isValid(uint8_t slot) { return slots.valid & (1 << slot); }
+        inline void convertStatusFiles();
+        bool checkIf(const char *); // Check old valid/preferred files
 
         inline bool findPreferredDB();
-        bool checkIf(const char *); // Check if file is valid/preferred
-        const char *currentFileIsValid;
-        const char *otherFileIsValid;
-        const char *currentFileIsPreferred;
-        const char *otherFileIsPreferred;
-
-        // This swaps current <-- other, other <-- current and sets
-        // "current" as preferred, but only if "other" is valid
+
+        // This swaps current <-- other, other <-- current and makes
+        // "current" the preferred one, but only if "other" is valid
         bool swapFiles();
 
-        // openDB(); if that fails, revert files and try again
-        void activateDBFile();
+        // openDB(); if that fails, revert files and try again; returns
+        // false if the current file is not the one we tried first
+        bool activateDBFile();
 
         // Something is wrong, delete the file
         inline void clearCurrentDBFile();
 
         File file;
+
+        bool downloadFailed = false;
+        bool payloadStarted;
+        uint32_t outputSize; // bytes written with writeToFile() and
+        uint32_t outputCRC;  // their CRC32, for chunks and patches
+        inline bool writeToFile(const uint8_t* data, size_t len);
+
+        // Compressed downloads; "inflater" is only allocated meanwhile
+        tinfl_decompressor* inflater = NULL;
+        tinfl_status inflateStatus;
+        size_t windowPos;
+        inline bool startInflating();
+        inline bool inflateToFile(const uint8_t* data, size_t len);
+        inline void stopInflating();
+
+        // SHA-256 of the downloaded file, checked before we use it
+        bool hasDigest;
+        size_t digestHeaderReceived;
+        DBDigestHeader digestHeader;
+        mbedtls_sha256_context sha;
+        inline void startHashing();
+        inline void updateHash(const uint8_t* data, size_t len);
+        inline void finishHashing(uint8_t* digest);
+        inline bool digestMatches();
+        inline bool fileDigest(const char* filename, uint8_t* digest);
+
+        // Digest of the current DB, to compare with the manifest
+        DBDigestRecord knownDigest;
+        inline bool currentDBDigest(unsigned int version, uint8_t* digest);
+        inline void forgetCurrentDBDigest();
+
+        // Chunked downloads
+        bool inChunk = false;
+        bool chunkStarted;
+        bool chunkSkipped; // a copy of a chunk we do not need
+        unsigned int chunkFailures = 0;
+        size_t chunkHeaderReceived;
+        DBChunkHeader chunkHeader;
+        DBChunkCursor cursor;
+        inline bool startChunk();
+        inline bool resumeChunkedDownload();
+        inline bool otherFileMatchesDigest(const uint8_t* digest);
+        inline void loadCursor();
+        inline void saveCursor();
+        inline void resetCursor();
+
+        char* delta = NULL;
+        size_t deltaSize = 0;
+        bool deltaTooLarge = false;
+        bool applyDelta(unsigned int base, unsigned int target,
+                        const char* sql);
+        inline bool copyCurrentFile();
+
+        // Empty deltas only change the version
+        DBVersionRecord versionAlias;
+        inline void bumpVersion(unsigned int base, unsigned int target);
+        inline void forgetVersionAlias();
+        inline unsigned int currentFileVersion();
+
+        // Binary patches; "file" is the output, "source" the current DB
+        enum { PATCH_HEADER, PATCH_OPCODE, PATCH_ARGS, PATCH_ADD } patchState;
+        bool patching = false;
+        bool patchSkipped;
+        bool patchFailed;
+        bool patchNeedsFullDB;
+        DBPatchHeader patchHeader;
+        char patchOpcode;
+        uint8_t patchArgs[8];
+        size_t patchArgsReceived;
+        size_t patchArgsExpected;
+        uint32_t patchAddRemaining;
+        uint32_t patchWritten;
+        uint32_t patchCRC;
+        File source;
+
+        inline ssize_t writeToPatch(const char* data, int data_len);
+        inline void startPatch();
+        inline void processPatchOp();
+        inline bool writePatchOutput(const uint8_t* data, size_t len);
+        inline bool copyFromCurrentFile(uint32_t offset, uint32_t len);
+        inline void finishPatch();
+        inline void cancelPatch();
+
+        // Mark the "other" file as valid and switch to it
+        inline void activateDownloadedFile();
+
+        uint8_t shardDigests[DB_SHARDS][HASH_SIZE];
+
+        // The shards have no DB version, but the flat index has; this is
+        // the version all of them are at (0 while some are outdated),
+        // saved in NVS, and the shards we need to get to the version of
+        // the last manifest
+        uint32_t shardsVersion;
+        uint32_t manifestVersion = 0;
+        uint32_t pendingShards = 0;
+        inline void setShardsVersion(uint32_t version);
     };  
 
     // This should be called from setup()
     inline void UpdateDBManager::init() {
         diskOK = true;
 
-        currentFile = "/DB_A.db";
-        otherFile = "/DB_B.db";
-        currentFileIsValid = "/VALID_A.TXT";
-        otherFileIsValid = "/VALID_B.TXT";
-        currentFileIsPreferred = "/PREF_A.TXT";
-        otherFileIsPreferred = "/PREF_B.TXT";
+        loadSlots();
+        loadCursor();
+        loadNVSBlob("dbdigest", &knownDigest, sizeof(knownDigest));
+        loadNVSBlob("dbversion", &versionAlias, sizeof(versionAlias));
+        aliasDBVersion(versionAlias.fileVersion, versionAlias.version);
+        if (DB_SHARDS > 1) {
+            loadNVSBlob("sharddigests", shardDigests, sizeof(shardDigests));
+            loadNVSBlob("shardversion", &shardsVersion,
+                        sizeof(shardsVersion));
+        }
 
-        if (findPreferredDB()) {
-            activateDBFile();
-        } else {
+        bool missing = false;
+        for (int k = 0; k < DB_SHARDS; ++k) {
+            selectShard(k);
+            if (findPreferredDB()) {
+                activateDBFile();
+            } else {
+                missing = true;
+            }
+        }
+        selectShard(0);
+        if (DB_SHARDS > 1) { setDBShardsVersion(shardsVersion); }
+
+        if (missing) {
             log_e("No valid DB file, downloading a fresh one");
             forceDBDownload();  // When this succeeds, the DB is activated
         }
@@ -91,10 +392,8 @@ namespace DBNS {
         }
         log_d("Starting DB download");
 
-        if (DISK.exists(otherFileIsValid)) { DISK.remove(otherFileIsValid); };
-        if (DISK.exists(otherFileIsPreferred))
-                                        { DISK.remove(otherFileIsPreferred); };
-        if (DISK.exists(otherFile)) { DISK.remove(otherFile); };
+        setValid(1 - slots.current, false);
+        if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
 
         file = DISK.open(otherFile, FILE_WRITE, true);
 
@@ -108,21 +407,201 @@ namespace DBNS {
         return true;
     }
 
+    /*
+      The server may compress the DB (zlib format, RFC 1950), which makes
+      downloads of DBs with hexadecimal hashes about twice as fast. We
+      tell it apart from a plain SQLite file by its header and inflate it
+      as it arrives with tinfl (from miniz, which is in the ESP32 ROM).
+      Instead of a 32 KB dictionary, we use a small circular buffer
+      (inflateWindow), flushed to the file whenever it fills up; this
+      only works if the server uses a deflate window no larger than
+      that, which tinfl checks when it reads the zlib header. tinfl also
+      checks the Adler-32 at the end of the stream, so if the download
+      is corrupted or truncated we keep the current DB.
+    */
+    static uint8_t inflateWindow[DB_INFLATE_WINDOW_SIZE];
+
+    static inline bool isZlibStream(const char* data, int data_len) {
+        if (data_len < 2) { return false; }
+        uint8_t cmf = data[0];
+        uint8_t flg = data[1];
+        return (cmf & 0x0F) == 8 and ((cmf << 8) | flg) % 31 == 0;
+    }
+
+    inline bool UpdateDBManager::startInflating() {
+        inflater = (tinfl_decompressor*) malloc(sizeof(tinfl_decompressor));
+        if (inflater == NULL) {
+            log_w("Not enough memory to inflate the DB");
+            return false;
+        }
+
+        log_d("DB download is compressed");
+        tinfl_init(inflater);
+        inflateStatus = TINFL_STATUS_NEEDS_MORE_INPUT;
+        windowPos = 0;
+        return true;
+    }
+
+    inline bool UpdateDBManager::inflateToFile(const uint8_t* data,
+                                               size_t len) {
+
+        while (inflateStatus != TINFL_STATUS_DONE) {
+            size_t inBytes = len;
+            size_t outBytes = DB_INFLATE_WINDOW_SIZE - windowPos;
+            inflateStatus = tinfl_decompress(inflater, data, &inBytes,
+                                             inflateWindow,
+                                             inflateWindow + windowPos,
+                                             &outBytes,
+                                             TINFL_FLAG_PARSE_ZLIB_HEADER
+                                             | TINFL_FLAG_HAS_MORE_INPUT
+                                             | TINFL_FLAG_COMPUTE_ADLER32);
+            data += inBytes;
+            len -= inBytes;
+
+            if (inflateStatus < TINFL_STATUS_DONE) {
+                log_e("Error (%d) inflating DB", inflateStatus);
+                return false;
+            }
+
+            if (not writeToFile(inflateWindow + windowPos, outBytes)) {
+                return false;
+            }
+            windowPos = (windowPos + outBytes) & (DB_INFLATE_WINDOW_SIZE -1);
+
+            if (inflateStatus == TINFL_STATUS_NEEDS_MORE_INPUT) { break; }
+        }
+
+        if (len > 0 and inflateStatus == TINFL_STATUS_DONE) {
+            log_e("Unexpected data after the compressed DB");
+            return false;
+        }
+
+        return true;
+    }
+
+    inline void UpdateDBManager::stopInflating() {
+        free(inflater);
+        inflater = NULL;
+    }
+
+    /*
+      The server also puts a header with the SHA-256 of the DB file before
+      the DB (compressed or not). We hash the file as we write it and, if
+      the result does not match, we discard it in finishDBDownload(),
+      before closing the current DB. Without this, a bad file would only
+      be noticed when SQLite fails to open it, after the swap, which means
+      closing the current DB and reverting to it. DBs without the header
+      (from older servers) are still accepted.
+    */
+    inline void UpdateDBManager::startHashing() {
+        mbedtls_sha256_init(&sha);
+        sha256Starts(&sha);
+    }
+
+    inline bool UpdateDBManager::writeToFile(const uint8_t* data,
+                                             size_t len) {
+
+        if (file.write(data, len) != len) {
+            log_e("Error writing DB file");
+            return false;
+        }
+
+        if (hasDigest) { updateHash(data, len); }
+        outputSize += len;
+        outputCRC = esp_crc32_le(outputCRC, data, len);
+
+        return true;
+    }
+
+    inline void UpdateDBManager::updateHash(const uint8_t* data, size_t len) {
+        sha256Update(&sha, data, len);
+    }
+
+    inline void UpdateDBManager::finishHashing(uint8_t* digest) {
+        sha256Finish(&sha, digest);
+    }
+
+    inline bool UpdateDBManager::digestMatches() {
+        uint8_t digest[HASH_SIZE];
+        finishHashing(digest);
+        return 0 == memcmp(digest, digestHeader.digest, HASH_SIZE);
+    }
+
+    inline bool UpdateDBManager::fileDigest(const char* filename,
+                                            uint8_t* digest) {
+        static uint8_t buf[512];
+
+        File f = DISK.open(filename);
+        if (not f) { return false; }
+
+        startHashing();
+        int n;
+        while ((n = f.read(buf, sizeof(buf))) > 0) { updateHash(buf, n); }
+        f.close();
+
+        finishHashing(digest);
+        mbedtls_sha256_free(&sha);
+        return true;
+    }
+
     inline ssize_t UpdateDBManager::writeToDatabaseFile(const char* data,
                                                         int data_len) {
 
         if (not diskOK) { return data_len; }
 
+        ssize_t received = data_len;
+
         if (!downloading) {
             if (!startDBDownload()) {
                 // TODO: Do something smart here
                 log_w("Cannot start download!");
                 return -1;
             }
+            downloadFailed = false;
+            payloadStarted = false;
+            outputSize = 0;
+            outputCRC = 0;
+            digestHeaderReceived = 0;
+            hasDigest = data_len >= 8
+                            and 0 == memcmp(data, DB_DIGEST_MAGIC, 8);
+            if (hasDigest) { startHashing(); }
         }
         downloading = true;
 
-        return file.write((byte *)data, data_len);
+        if (downloadFailed) { return -1; }
+
+        if (hasDigest and digestHeaderReceived < sizeof(digestHeader)) {
+            size_t n = sizeof(digestHeader) - digestHeaderReceived;
+            if (n > data_len) { n = data_len; }
+            memcpy((uint8_t*) &digestHeader + digestHeaderReceived, data, n);
+            digestHeaderReceived += n;
+            data += n;
+            data_len -= n;
+        }
+
+        if (data_len == 0) { return received; }
+
+        if (not payloadStarted) {
+            payloadStarted = true;
+            if (isZlibStream(data, data_len) and not startInflating()) {
+                downloadFailed = true;
+                return -1;
+            }
+        }
+
+        bool ok;
+        if (inflater == NULL) {
+            ok = writeToFile((const uint8_t*) data, data_len);
+        } else {
+            ok = inflateToFile((const uint8_t*) data, data_len);
+        }
+
+        if (not ok) {
+            downloadFailed = true;
+            return -1;
+        }
+
+        return received;
     }
 
     inline void UpdateDBManager::finishDBDownload() {
@@ -132,15 +611,63 @@ namespace DBNS {
 
         downloading = false;
         file.close();
+
+        if (inflater != NULL) {
+            if (not downloadFailed and inflateStatus != TINFL_STATUS_DONE) {
+                log_e("Compressed DB is truncated");
+                downloadFailed = true;
+            }
+            stopInflating();
+        }
+
+        if (hasDigest) {
+            if (not downloadFailed and (
+                        digestHeaderReceived < sizeof(digestHeader)
+                        or not digestMatches())) {
+
+                log_e("DB download does not match its SHA-256 digest");
+                downloadFailed = true;
+            }
+            mbedtls_sha256_free(&sha);
+        }
+
+        if (downloadFailed) {
+            log_e("DB download failed, keeping the current DB");
+            if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
+            return;
+        }
+
         log_d("Finished DB download");
 
-        File f = DISK.open(otherFileIsValid, FILE_WRITE, true);
-        f.print(1);
-        f.close();
+        activateDownloadedFile();
+    }
 
-        closeDB();
+    inline void UpdateDBManager::activateDownloadedFile() {
+        // A chunked download in progress would resume into the old DB
+        if (cursor.nextChunk > 0) { resetCursor(); }
+        forgetCurrentDBDigest();
+        forgetVersionAlias();
+
+        // Marking it as valid and making it current is a single NVS write
+        slots.valid |= 1 << (1 - slots.current);
         swapFiles();
-        activateDBFile();
+        bool activated = activateDBFile();
+
+        // If we reverted, the old digest still matches the current file
+        if (DB_SHARDS > 1 and activated) {
+            if (hasDigest) {
+                memcpy(shardDigests[shard], digestHeader.digest, HASH_SIZE);
+            } else {
+                memset(shardDigests[shard], 0, HASH_SIZE); // unknown
+            }
+            saveNVSBlob("sharddigests", shardDigests, sizeof(shardDigests));
+
+            uint32_t bit = 1 << shard;
+            if (pendingShards & bit) {
+                pendingShards &= ~bit;
+                if (pendingShards == 0) { setShardsVersion(manifestVersion); }
+            }
+        }
     }
 
     inline void UpdateDBManager::cancelDBDownload() {
@@ -151,145 +678,1311 @@ namespace DBNS {
         downloading = false;
         log_i("DB download cancelled");
         file.close();
+        stopInflating();
+        if (hasDigest) { mbedtls_sha256_free(&sha); }
 
-        if (DISK.exists(otherFile)) { DISK.remove(otherFile); };
+        if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
     }
 
-    void UpdateDBManager::activateDBFile() {
-        log_d("Activating DB file");
+    /*
+      Instead of sending the whole DB for each change, the server may
+      send a "delta" on /topic/dbdelta (a retained message, so we also
+      get the latest one when we connect), with this format:
 
-        if (openDB(currentFile) == SQLITE_OK) { return; }
+          DELTA <base version> <target version>\n
+          <SQL statements>
 
-        closeDB();
-        log_w("Error opening the updated DB, reverting to old one");
-        clearCurrentDBFile();
+      The DB version is "PRAGMA user_version". If the current DB is at
+      the base version, we apply the SQL statements and set the version
+      to the target in a single transaction; if it is already at (or
+      beyond) the target, we ignore the delta; otherwise, we missed some
+      update, so we download the full DB. The server may also send
 
-        if (not swapFiles()) {
-            log_w("Cannot revert to old DB, downloading a fresh file");
-            forceDBDownload();
-            return;
+          FULL <target version>\n
+
+      when it cannot generate a delta, meaning "if you do not have this
+      version, download the full DB".
+
+      We apply the SQL statements to a copy of the current DB, in the
+      "other" file, and then swap the files just like after a full
+      download, so the Authorizer keeps answering with the current DB
+      while the delta is applied. If the update fails, we download the
+      full DB.
+
+      For bulk changes, the SQL would be too large, so the server may
+      send a binary patch instead (check applyPatch below), recognized
+      by its DB_PATCH_MAGIC prefix.
+
+      A delta with no SQL statements means that only the version changed
+      (check bumpVersion() below), so the base version of a delta is that
+      of the file, which may be older than the version of the DB.
+    */
+    inline ssize_t UpdateDBManager::writeToDBDelta(const char* data,
+                                                   int data_len) {
+
+        if (not diskOK) { return data_len; }
+
+        if (not patching and deltaSize == 0 and not deltaTooLarge
+                and data_len >= 8 and 0 == memcmp(data, DB_PATCH_MAGIC, 8)) {
+
+            patching = true;
+            patchState = PATCH_HEADER;
+            patchArgsReceived = 0;
+            patchSkipped = false;
+            patchFailed = false;
+            patchNeedsFullDB = false;
         }
 
-        if (openDB(currentFile) == SQLITE_OK) { return; }
+        if (patching) { return writeToPatch(data, data_len); }
 
-        closeDB();
-        log_w("Reverting to old DB failed, downloading a fresh file");
-        clearCurrentDBFile();
-        forceDBDownload();
-    }
+        if (deltaTooLarge) { return data_len; }
 
-    bool UpdateDBManager::swapFiles() {
-        if (not checkIf(otherFileIsValid)) { return false; }
-
-        const char *tmp = currentFile;
-        currentFile = otherFile;
-        otherFile = tmp;
-        tmp = currentFileIsPreferred;
-        currentFileIsPreferred = otherFileIsPreferred;
-        otherFileIsPreferred = tmp;
-        tmp = currentFileIsValid;
-        currentFileIsValid = otherFileIsValid;
-        otherFileIsValid = tmp;
-
-        // If we crash before these 5 lines, on restart we will continue
-        // using the old version of the DB; if we crash after, we will
-        // use the new version of the DB. If we crash in the middle (with
-        // both files containing "1"), on restart we will use "DB_A.db",
-        // which may be either.
-
-        File f = DISK.open(currentFileIsPreferred, FILE_WRITE, true);
-        f.print(1);
-        f.close();
+        if (deltaSize + data_len > DB_DELTA_MAX_SIZE) {
+            log_w("DB delta is too large");
+            deltaTooLarge = true;
+            free(delta);
+            delta = NULL;
+            deltaSize = 0;
+            return data_len;
+        }
 
-        f = DISK.open(otherFileIsPreferred, FILE_WRITE, true);
-        f.print(0);
-        f.close();
+        char* tmp = (char*) realloc(delta, deltaSize + data_len +1);
+        if (tmp == NULL) {
+            log_w("Not enough memory for the DB delta");
+            deltaTooLarge = true;
+            free(delta);
+            delta = NULL;
+            deltaSize = 0;
+            return -1;
+        }
 
-        return true;
+        delta = tmp;
+        memcpy(delta + deltaSize, data, data_len);
+        deltaSize += data_len;
+        delta[deltaSize] = 0;
+
+        return data_len;
     }
 
-    bool UpdateDBManager::checkIf(const char *filename) {
-        // In some exceptional circumstances, we might end up writing
-        // "1" to the file more than once; that's ok, 11 > 0 too :) .
+    inline void UpdateDBManager::finishDBDelta() {
+        if (not diskOK) { return; }
 
-        if (!DISK.exists(filename)) { return false; }
-        File f = DISK.open(filename);
-        if (!f) { return false; }
+        if (patching) {
+            finishPatch();
+            return;
+        }
 
-        int t = 0;
-        if (f.available()) {
-            t = f.parseInt(); // If reading fails, this returns 0
+        bool tooLarge = deltaTooLarge;
+        char* msg = delta;
+        delta = NULL;
+        deltaSize = 0;
+        deltaTooLarge = false;
+
+        unsigned int base, target;
+        unsigned int current = currentDBVersion();
+        unsigned int fileVersion = currentFileVersion();
+        const char* sql = msg == NULL ? NULL : strchr(msg, '\n');
+
+        if (downloading or cursor.nextChunk > 0) {
+            log_i("Ignoring DB delta during full DB download");
+        } else if (tooLarge) {
+            forceDBDownload();
+        } else if (msg == NULL) {
+            log_w("Empty DB delta");
+        } else if (sscanf(msg, "FULL %u", &target) == 1) {
+            if (target != fileVersion) {
+                log_i("DB version %u available (we have %u), downloading",
+                      target, current);
+                forceDBDownload();
+            }
+        } else if (sql == NULL or sscanf(msg, "DELTA %u %u",
+                                         &base, &target) != 2) {
+            log_e("Invalid DB delta");
+        } else if (target <= current) {
+            log_d("Ignoring DB delta %u -> %u, we have version %u",
+                  base, target, current);
+        } else if (base != fileVersion) {
+            log_i("Missed some DB update (delta %u -> %u, we have version "
+                  "%u), downloading the full DB", base, target, current);
+            forceDBDownload();
+        } else if (sql[strspn(sql, " \t\r\n")] == 0) {
+            bumpVersion(base, target);
+        } else if (not applyDelta(base, target, sql)) {
+            forceDBDownload();
         }
-        f.close();
-        return t > 0;
+
+        free(msg);
     }
 
-    inline bool UpdateDBManager::findPreferredDB() {
-        if (not checkIf(currentFileIsValid)) { return swapFiles(); }
+    inline void UpdateDBManager::cancelDBDelta() {
+        if (patching) { cancelPatch(); }
+        free(delta);
+        delta = NULL;
+        deltaSize = 0;
+        deltaTooLarge = false;
+    }
 
-        if (not checkIf(otherFileIsValid)) { return true; }
+    bool UpdateDBManager::applyDelta(unsigned int base, unsigned int target,
+                                     const char* sql) {
 
-        if (checkIf(currentFileIsPreferred)) {
-            return true;
-        } else {
-            return swapFiles(); // always true
+        unsigned long start = millis();
+        if (not copyCurrentFile()) { return false; }
+
+        char name[50];
+        diskPath(otherFile, name, sizeof(name));
+
+        sqlite3* db;
+        int rc = sqlite3_open(name, &db);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        }
+        if (rc == SQLITE_OK) {
+            char pragma[40];
+            snprintf(pragma, 40, "PRAGMA user_version=%u", target);
+            rc = sqlite3_exec(db, pragma, NULL, NULL, NULL);
         }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        }
+
+        if (rc != SQLITE_OK) {
+            log_e("Error applying DB delta %u -> %u: %s", base, target,
+                  sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        }
+        sqlite3_close_v2(db);
+
+        if (rc != SQLITE_OK) {
+            if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
+            return false;
+        }
+
+        log_i("Applied DB delta %u -> %u in %lu ms", base, target,
+              millis() - start);
+
+        hasDigest = false; // that of the last download, not of this file
+        activateDownloadedFile();
+
+        // The file is not the same as the one the server publishes for
+        // this version, so checkDBManifest() only compares the version
+        if (currentDBVersion() == target) {
+            knownDigest.version = target;
+            knownDigest.fromDelta = 1;
+            saveNVSBlob("dbdigest", &knownDigest, sizeof(knownDigest));
+        }
+        return true;
     }
 
-    inline void UpdateDBManager::clearCurrentDBFile() {
-        if (DISK.exists(currentFile)) { DISK.remove(currentFile); };
-        if (DISK.exists(currentFileIsPreferred))
-                                        { DISK.remove(currentFileIsPreferred); };
-        if (DISK.exists(currentFileIsValid))
-                                        { DISK.remove(currentFileIsValid); };
+    /*
+      With DB_PER_DOOR, most new versions of the DB do not change the
+      slice of this door, but the flat index is generated from the new
+      version and is only used if our DB is at that version too. So, if
+      the slice did not change, the server only sends an empty delta from
+      the version of the slice it published last (check
+      poc_manager/door_controller.py). Applying it like any other delta
+      would mean copying the whole file just to change its version, so
+      instead we keep the file as it is and remember (in NVS) that it is
+      at the new version; the Authorizer uses that version for the flat
+      index. Deltas, patches and manifests refer to the file, so they
+      still use its "PRAGMA user_version" (check currentFileVersion()).
+      When a new file is activated, this no longer applies.
+    */
+    inline void UpdateDBManager::bumpVersion(unsigned int base,
+                                             unsigned int target) {
+
+        versionAlias.fileVersion = base;
+        versionAlias.version = target;
+        saveNVSBlob("dbversion", &versionAlias, sizeof(versionAlias));
+        aliasDBVersion(base, target);
+        log_i("DB version %u -> %u, the DB did not change", base, target);
     }
 
+    inline void UpdateDBManager::forgetVersionAlias() {
+        if (versionAlias.version == 0) { return; }
+        memset(&versionAlias, 0, sizeof(versionAlias));
+        saveNVSBlob("dbversion", &versionAlias, sizeof(versionAlias));
+        aliasDBVersion(0, 0);
+    }
 
-    UpdateDBManager updateDBManager;
-}
+    inline unsigned int UpdateDBManager::currentFileVersion() {
+        unsigned int current = currentDBVersion();
+        if (versionAlias.version != 0 and versionAlias.version == current) {
+            return versionAlias.fileVersion;
+        }
+        return current;
+    }
 
-void initDBMan() { DBNS::updateDBManager.init(); }
+    // Copies the current DB to the "other" file, which is only marked as
+    // valid later, by activateDownloadedFile()
+    inline bool UpdateDBManager::copyCurrentFile() {
+        static uint8_t buf[512];
 
-ssize_t writeToDatabaseFile(const char* data, int data_len) {
-    return DBNS::updateDBManager.writeToDatabaseFile(data, data_len);
-}
+        source = DISK.open(currentFile);
+        if (not source or not startDBDownload()) {
+            log_w("Cannot copy the current DB file");
+            if (source) { source.close(); }
+            return false;
+        }
 
-void finishDBDownload() { return DBNS::updateDBManager.finishDBDownload(); }
+        bool ok = true;
+        int n;
+        while (ok and (n = source.read(buf, sizeof(buf))) > 0) {
+            ok = file.write(buf, n) == (size_t) n;
+        }
+        source.close();
+        file.close();
 
-void cancelDBDownload() { return DBNS::updateDBManager.cancelDBDownload(); }
+        if (not ok) {
+            log_w("Error copying the current DB file");
+            if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
+        }
 
-bool wipeDBFiles() {
-    log_i("Wiping all DB files");
-    closeDB();
-    if (not DISK.remove("/DB_A.db")) {
-        log_w("Something wrong happened while removing DB file /DB_A.db");
-        return false;
+        return ok;
     }
 
-    if (not DISK.remove("/DB_B.db")) {
-        log_w("Something wrong happened while removing DB file /DB_B.db");
-        return false;
+    /*
+      A binary patch is a DBPatchHeader followed by a sequence of
+      operations that build the new DB file (all integers are uint32,
+      little-endian):
+
+          'C' <offset> <length>  copy these bytes from the current file
+          'A' <length> <data>    append these bytes
+
+      The server generates it by comparing the SQLite pages of the
+      previous and of the new DB (check poc_manager/dbpatch.py), so bulk
+      changes cost roughly as many bytes as the pages they touch. This
+      works just like a full download, except that the data comes partly
+      from the message and partly from the current file: we write the
+      "other" file while the Authorizer keeps using the current one and,
+      if the result has the expected size and CRC, we swap them. The
+      version rules are the same as for SQL deltas and, if anything goes
+      wrong, we download the full DB.
+
+      The CRC also protects us if our file is at the base version but
+      not byte-by-byte identical to the server's copy of it, which may
+      happen after a SQL delta.
+    */
+    inline ssize_t UpdateDBManager::writeToPatch(const char* data,
+                                                 int data_len) {
+
+        const uint8_t* bytes = (const uint8_t*) data;
+        int pos = 0;
+
+        while (pos < data_len and not patchSkipped and not patchFailed) {
+            size_t n;
+            switch (patchState) {
+                case PATCH_HEADER:
+                    n = sizeof(patchHeader) - patchArgsReceived;
+                    if (n > data_len - pos) { n = data_len - pos; }
+                    memcpy((uint8_t*) &patchHeader + patchArgsReceived,
+                           bytes + pos, n);
+                    pos += n;
+                    patchArgsReceived += n;
+                    if (patchArgsReceived == sizeof(patchHeader)) {
+                        startPatch();
+                    }
+                    break;
+
+                case PATCH_OPCODE:
+                    patchOpcode = bytes[pos++];
+                    patchArgsReceived = 0;
+                    patchArgsExpected = patchOpcode == 'C' ? 8 : 4;
+                    patchState = PATCH_ARGS;
+                    if (patchOpcode != 'C' and patchOpcode != 'A') {
+                        log_w("Invalid DB patch operation");
+                        patchFailed = true;
+                    }
+                    break;
+
+                case PATCH_ARGS:
+                    n = patchArgsExpected - patchArgsReceived;
+                    if (n > data_len - pos) { n = data_len - pos; }
+                    memcpy(patchArgs + patchArgsReceived, bytes + pos, n);
+                    pos += n;
+                    patchArgsReceived += n;
+                    if (patchArgsReceived == patchArgsExpected) {
+                        processPatchOp();
+                    }
+                    break;
+
+                case PATCH_ADD:
+                    n = patchAddRemaining;
+                    if (n > data_len - pos) { n = data_len - pos; }
+                    if (not writePatchOutput(bytes + pos, n)) {
+                        patchFailed = true;
+                    }
+                    pos += n;
+                    patchAddRemaining -= n;
+                    if (patchAddRemaining == 0) { patchState = PATCH_OPCODE; }
+                    break;
+            }
+        }
+
+        return data_len;
     }
 
-    if (not DISK.remove("/VALID_A.TXT")) {
-        log_w("Something wrong happened while removing DB file /VALID_A.TXT");
-        return false;
+    inline void UpdateDBManager::startPatch() {
+        unsigned int base = patchHeader.baseVersion;
+        unsigned int target = patchHeader.targetVersion;
+        unsigned int current = currentDBVersion();
+        unsigned int fileVersion = currentFileVersion();
+
+        if (downloading or cursor.nextChunk > 0) {
+            log_i("Ignoring DB patch during full DB download");
+            patchSkipped = true;
+        } else if (target <= current) {
+            log_d("Ignoring DB patch %u -> %u, we have version %u",
+                  base, target, current);
+            patchSkipped = true;
+        } else if (base != fileVersion) {
+            log_i("Missed some DB update (patch %u -> %u, we have version "
+                  "%u), downloading the full DB", base, target, current);
+            patchSkipped = true;
+            patchNeedsFullDB = true;
+        } else {
+            source = DISK.open(currentFile);
+            if (not source or not startDBDownload()) {
+                log_w("Cannot apply DB patch");
+                patchSkipped = true;
+                patchNeedsFullDB = true;
+                if (source) { source.close(); }
+                return;
+            }
+
+            log_d("Applying DB patch %u -> %u", base, target);
+            patchWritten = 0;
+            patchCRC = 0;
+            patchState = PATCH_OPCODE;
+        }
     }
 
-    if (not DISK.remove("/VALID_B.TXT")) {
-        log_w("Something wrong happened while removing DB file /VALID_B.TXT");
-        return false;
+    inline void UpdateDBManager::processPatchOp() {
+        uint32_t first, second;
+        memcpy(&first, patchArgs, 4);
+        memcpy(&second, patchArgs + 4, 4);
+
+        if (patchOpcode == 'C') {
+            if (not copyFromCurrentFile(first, second)) { patchFailed = true; }
+            patchState = PATCH_OPCODE;
+        } else {
+            patchAddRemaining = first;
+            patchState = first == 0 ? PATCH_OPCODE : PATCH_ADD;
+        }
     }
 
-    if (not DISK.remove("/PREF_A.TXT")) {
-        log_w("Something wrong happened while removing DB file /PREF_A.TXT");
-        return false;
+    inline bool UpdateDBManager::writePatchOutput(const uint8_t* data,
+                                                  size_t len) {
+
+        if (patchWritten + len > patchHeader.targetSize) {
+            log_w("DB patch output is larger than announced");
+            return false;
+        }
+
+        if (file.write(data, len) != len) {
+            log_w("Error writing patched DB file");
+            return false;
+        }
+
+        patchCRC = esp_crc32_le(patchCRC, data, len);
+        patchWritten += len;
+        return true;
     }
 
-    if (not DISK.remove("/PREF_B.TXT")) {
-        log_w("Something wrong happened while removing DB file /PREF_B.TXT");
-        return false;
+    inline bool UpdateDBManager::copyFromCurrentFile(uint32_t offset,
+                                                     uint32_t len) {
+
+        static uint8_t buf[512];
+
+        if (not source.seek(offset)) {
+            log_w("DB patch refers to data beyond the current file");
+            return false;
+        }
+
+        while (len > 0) {
+            size_t n = len > sizeof(buf) ? sizeof(buf) : len;
+            if (source.read(buf, n) != n) {
+                log_w("DB patch refers to data beyond the current file");
+                return false;
+            }
+            if (not writePatchOutput(buf, n)) { return false; }
+            len -= n;
+        }
+
+        return true;
     }
 
-    return true;
-}
+    inline void UpdateDBManager::finishPatch() {
+        patching = false;
+
+        if (patchState == PATCH_HEADER and not patchSkipped) {
+            log_e("Invalid DB patch");
+            return;
+        }
+
+        if (patchSkipped) {
+            if (patchNeedsFullDB) { forceDBDownload(); }
+            return;
+        }
+
+        source.close();
+        file.close();
+
+        if (patchFailed or patchState != PATCH_OPCODE
+                        or patchWritten != patchHeader.targetSize
+                        or patchCRC != patchHeader.targetCRC) {
+
+            log_w("DB patch %u -> %u failed, downloading the full DB",
+                  patchHeader.baseVersion, patchHeader.targetVersion);
+            if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
+            forceDBDownload();
+            return;
+        }
+
+        log_i("Applied DB patch %u -> %u", patchHeader.baseVersion,
+              patchHeader.targetVersion);
+
+        activateDownloadedFile();
+    }
+
+    inline void UpdateDBManager::cancelPatch() {
+        patching = false;
+        if (patchSkipped or patchState == PATCH_HEADER) { return; }
+
+        log_i("DB patch cancelled");
+        source.close();
+        file.close();
+        if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
+    }
+
+    /*
+      A large DB may take minutes to download and, if the connection
+      drops in the middle, we would have to start over. So, the server
+      also splits the DB in chunks (check poc_manager/dbchunks.py), each
+      one a retained message on its own topic (/topic/dbchunk/<index>),
+      with a DBChunkHeader followed by the chunk, compressed just like a
+      full DB download. The MQTT manager subscribes to one chunk at a
+      time, the one "cursor" says we need next; we append each chunk to
+      the "other" file and save the cursor in NVS, so after a reconnect
+      or a reboot we continue from where we stopped, truncating whatever
+      part of an unfinished chunk we wrote. If a chunk fails too many
+      times in a row, we give up, just like with a failed full download.
+
+      All chunks carry the digest of the whole DB and the number of
+      chunks: if chunk 0 arrives with another digest or count, the server
+      published a new DB and we start over. Retained chunks are often
+      delivered more than once (when we reconnect, for instance) and the
+      broker may keep chunks of an older DB, so we simply ignore chunks
+      we already have and chunks of other DBs; only if the chunk we need
+      belongs to another DB do we start over. When the last chunk
+      arrives, we check the digest of the whole file and swap the files
+      as usual.
+    */
+    inline ssize_t UpdateDBManager::writeToDBChunk(const char* data,
+                                                   int data_len) {
+
+        if (not diskOK) { return data_len; }
+
+        if (not inChunk) {
+            inChunk = true;
+            chunkStarted = false;
+            chunkSkipped = false;
+            chunkHeaderReceived = 0;
+            downloadFailed = false;
+        }
+
+        if (downloadFailed) { return data_len; }
+
+        if (chunkHeaderReceived < sizeof(chunkHeader)) {
+            size_t n = sizeof(chunkHeader) - chunkHeaderReceived;
+            if (n > data_len) { n = data_len; }
+            memcpy((uint8_t*) &chunkHeader + chunkHeaderReceived, data, n);
+            chunkHeaderReceived += n;
+            data += n;
+            data_len -= n;
+
+            if (chunkHeaderReceived < sizeof(chunkHeader)) { return n; }
+
+            if (not startChunk()) {
+                downloadFailed = true;
+                return n;
+            }
+            chunkStarted = true;
+        }
+
+        if (data_len == 0) { return data_len; }
+
+        if (not payloadStarted) {
+            payloadStarted = true;
+            if (isZlibStream(data, data_len) and not startInflating()) {
+                downloadFailed = true;
+                return -1;
+            }
+        }
+
+        bool ok;
+        if (inflater == NULL) {
+            ok = writeToFile((const uint8_t*) data, data_len);
+        } else {
+            ok = inflateToFile((const uint8_t*) data, data_len);
+        }
+
+        if (not ok) {
+            downloadFailed = true;
+            return -1;
+        }
+
+        return data_len;
+    }
+
+    inline bool UpdateDBManager::startChunk() {
+        DBChunkHeader& h = chunkHeader;
+        if (memcmp(h.magic, DB_CHUNK_MAGIC, 8) or h.index >= h.count) {
+            log_e("Invalid DB chunk");
+            return false;
+        }
+
+        bool sameDB = cursor.nextChunk > 0 and h.count == cursor.count
+                      and 0 == memcmp(h.digest, cursor.digest, HASH_SIZE);
+
+        if (sameDB and h.index != cursor.nextChunk) {
+            log_d("Ignoring DB chunk %u, we need chunk %u", h.index,
+                  cursor.nextChunk);
+            chunkSkipped = true;
+            return false;
+        }
+
+        if (h.index == 0) {
+            if (h.offset != 0 or not startDBDownload()) { return false; }
+            memcpy(cursor.digest, h.digest, HASH_SIZE);
+            cursor.nextChunk = 0;
+            cursor.count = h.count;
+            cursor.nextOffset = 0;
+            log_i("Starting chunked DB download (%u chunks)", h.count);
+        } else if (not sameDB) {
+            chunkSkipped = true;
+            if (h.index != cursor.nextChunk) {
+                log_d("Ignoring DB chunk %u of another DB", h.index);
+                return false;
+            }
+            log_i("DB chunk %u belongs to another DB; starting over",
+                  h.index);
+            resetCursor();
+            return false;
+        } else if (h.offset != cursor.nextOffset) {
+            log_e("DB chunk %u does not start where chunk %u ended",
+                  h.index, h.index -1);
+            resetCursor();
+            return false;
+        } else if (not resumeChunkedDownload()) {
+            resetCursor();
+            return false;
+        }
+
+        payloadStarted = false;
+        hasDigest = false; // we check the whole file at the end
+        outputSize = 0;
+        outputCRC = 0;
+        return true;
+    }
+
+    inline bool UpdateDBManager::resumeChunkedDownload() {
+        char name[50];
+        diskPath(otherFile, name, sizeof(name));
+
+        struct stat st;
+        if (stat(name, &st) != 0 or st.st_size < cursor.nextOffset) {
+            log_w("Partially downloaded DB is missing, starting over");
+            return false;
+        }
+
+        if (st.st_size > cursor.nextOffset
+                and truncate(name, cursor.nextOffset) != 0) {
+
+            log_w("Cannot truncate partially downloaded DB, starting over");
+            return false;
+        }
+
+        file = DISK.open(otherFile, FILE_APPEND);
+        if (not file) {
+            log_w("Error opening partially downloaded DB, starting over");
+            return false;
+        }
+
+        log_d("Resuming DB download at chunk %u", cursor.nextChunk);
+        return true;
+    }
+
+    inline bool UpdateDBManager::finishDBChunk() {
+        if (not diskOK) { return true; }
+        inChunk = false;
+
+        // We still need the next chunk, but nothing failed
+        if (chunkSkipped) { return false; }
+
+        if (not chunkStarted) {
+            downloadFailed = true; // invalid or stale, check startChunk()
+        } else {
+            file.close();
+            if (inflater != NULL) {
+                if (not downloadFailed
+                        and inflateStatus != TINFL_STATUS_DONE) {
+
+                    log_e("Compressed DB chunk is truncated");
+                    downloadFailed = true;
+                }
+                stopInflating();
+            }
+        }
+
+        if (downloadFailed or outputSize != chunkHeader.size
+                           or outputCRC != chunkHeader.crc) {
+
+            if (++chunkFailures < DB_CHUNK_MAX_RETRIES) {
+                // We truncate it when we try again
+                log_w("DB chunk %u is corrupted", chunkHeader.index);
+                return false;
+            }
+            log_e("DB chunk %u is corrupted, giving up", chunkHeader.index);
+            chunkFailures = 0;
+            resetCursor();
+            return true;
+        }
+
+        chunkFailures = 0;
+        cursor.nextChunk++;
+        cursor.nextOffset += outputSize;
+
+        if (cursor.nextChunk < cursor.count) {
+            saveCursor();
+            return false;
+        }
+
+        log_d("Finished chunked DB download");
+        uint8_t digest[HASH_SIZE];
+        memcpy(digest, cursor.digest, HASH_SIZE);
+        resetCursor();
+
+        if (not otherFileMatchesDigest(digest)) {
+            log_e("DB download does not match its SHA-256 digest, "
+                  "keeping the current DB");
+            if (DISK.exists(otherFile)) { DISK.remove(otherFile); }
+            return true;
+        }
+
+        activateDownloadedFile();
+        return true;
+    }
+
+    inline void UpdateDBManager::cancelDBChunk() {
+        if (not inChunk) { return; }
+        inChunk = false;
+        if (not chunkStarted) { return; }
+
+        log_i("DB chunk download cancelled");
+        file.close();
+        stopInflating();
+    }
+
+    inline bool UpdateDBManager::otherFileMatchesDigest(const uint8_t* digest) {
+        uint8_t d[HASH_SIZE];
+        return fileDigest(otherFile, d) and 0 == memcmp(d, digest, HASH_SIZE);
+    }
+
+    inline void UpdateDBManager::loadCursor() {
+        loadNVSBlob("dbcursor", &cursor, sizeof(cursor));
+        if (cursor.nextChunk > 0) {
+            log_i("Chunked DB download in progress, at chunk %u of %u",
+                  cursor.nextChunk, cursor.count);
+        }
+    }
+
+    inline void UpdateDBManager::saveCursor() {
+        saveNVSBlob("dbcursor", &cursor, sizeof(cursor));
+    }
+
+    inline void UpdateDBManager::resetCursor() {
+        memset(&cursor, 0, sizeof(cursor));
+        saveCursor();
+    }
+
+    /*
+      On boot (and whenever something fails), we need the full DB, but
+      most of the time the DB we have is already the latest one and
+      downloading it again is a waste; after a power failure, all the
+      doors would do that at the same time. So, the server also publishes
+      a small retained "manifest" on /topic/dbmanifest:
+
+          MANIFEST <version> <SHA-256 of the DB, in hexadecimal>\n
+
+      and we only download the DB if ours is at a different version or
+      has a different digest. Computing the digest means reading the
+      whole file, so we remember it (in NVS) for the current version.
+      A DB updated with SQL deltas has the same contents as the published
+      one, but not the same bytes (the pages are laid out differently),
+      so in that case we only compare the version.
+    */
+    inline bool UpdateDBManager::checkDBManifest(const char* data,
+                                                 int data_len) {
+
+        if (not diskOK) { return false; } // not initialized yet
+
+        char msg[100];
+        snprintf(msg, sizeof(msg), "%.*s", data_len, data);
+
+        unsigned int version;
+        char hex[2 * HASH_SIZE + 1];
+        uint8_t digest[HASH_SIZE];
+        if (sscanf(msg, "MANIFEST %u %64s", &version, hex) != 2
+                or not hashFromHex(hex, digest)) {
+
+            log_e("Invalid DB manifest");
+            return false;
+        }
+
+        // A download of some other DB is useless now
+        if (cursor.nextChunk > 0
+                and memcmp(cursor.digest, digest, HASH_SIZE)) {
+
+            log_i("Dropping partial download of an outdated DB");
+            resetCursor();
+        }
+
+        // The manifest describes a file, so we compare it with ours even
+        // if an empty delta changed the version of the DB since then
+        unsigned int current = currentFileVersion();
+        if (version != current) {
+            log_i("DB version %u available (we have %u), downloading",
+                  version, current);
+            return false;
+        }
+
+        bool fromDelta = knownDigest.fromDelta
+                         and knownDigest.version == current;
+
+        uint8_t ours[HASH_SIZE];
+        if (not fromDelta and (not currentDBDigest(current, ours)
+                               or memcmp(ours, digest, HASH_SIZE))) {
+
+            log_i("Our DB differs from the published one, downloading");
+            return false;
+        }
+
+        log_i("DB version %u is up to date, not downloading it", version);
+        if (cursor.nextChunk > 0) { resetCursor(); }
+        return true;
+    }
+
+    inline bool UpdateDBManager::currentDBDigest(unsigned int version,
+                                                 uint8_t* digest) {
+
+        if (version == 0) { return false; } // no DB
+
+        if (knownDigest.version != version) {
+            unsigned long start = millis();
+            if (not fileDigest(currentFile, knownDigest.digest)) {
+                return false;
+            }
+            log_d("Computed digest of the current DB in %lu ms",
+                  millis() - start);
+            knownDigest.version = version;
+            knownDigest.fromDelta = 0;
+            saveNVSBlob("dbdigest", &knownDigest, sizeof(knownDigest));
+        }
+
+        memcpy(digest, knownDigest.digest, HASH_SIZE);
+        return true;
+    }
+
+    // A new DB may have the same version as the old one (if the server
+    // starts over, for example), so we forget the digest
+    inline void UpdateDBManager::forgetCurrentDBDigest() {
+        if (knownDigest.version == 0) { return; }
+        memset(&knownDigest, 0, sizeof(knownDigest));
+        saveNVSBlob("dbdigest", &knownDigest, sizeof(knownDigest));
+    }
+
+    bool UpdateDBManager::activateDBFile() {
+        log_d("Activating DB file %s", currentFile);
+
+        if (openDB(currentFile, shard) == SQLITE_OK) { return true; }
+
+        // If openDB() fails, the Authorizer keeps using the previous DB
+        log_w("Error opening the updated DB, reverting to old one");
+        clearCurrentDBFile();
+
+        if (not swapFiles()) {
+            closeDB(shard);
+            log_w("Cannot revert to old DB, downloading a fresh file");
+            forceDBDownload();
+            return false;
+        }
+
+        if (openDB(currentFile, shard) == SQLITE_OK) { return false; }
+
+        closeDB(shard);
+        log_w("Reverting to old DB failed, downloading a fresh file");
+        clearCurrentDBFile();
+        forceDBDownload();
+        return false;
+    }
+
+    bool UpdateDBManager::swapFiles() {
+        if (not isValid(1 - slots.current)) { return false; }
+
+        slots.current = 1 - slots.current;
+        saveSlots();
+        return true;
+    }
+
+    inline void UpdateDBManager::setValid(uint8_t slot, bool valid) {
+        if (isValid(slot) == valid) { return; }
+
+        if (valid) {
+            slots.valid |= 1 << slot;
+        } else {
+            slots.valid &= ~(1 << slot);
+        }
+        saveSlots();
+    }
+
+    inline void UpdateDBManager::setFileNames() {
+        dbFileName(shard, slots.current, currentFile, sizeof(currentFile));
+        dbFileName(shard, 1 - slots.current, otherFile, sizeof(otherFile));
+    }
+
+    // With a different number of shards, the record has a different
+    // size, so loadNVSBlob() fails and we start over (no file is valid)
+    inline void UpdateDBManager::loadSlots() {
+        bool found = loadNVSBlob("dbslots", allSlots, sizeof(allSlots));
+        for (int k = 0; k < DB_SHARDS; ++k) {
+            if (allSlots[k].current > 1) { allSlots[k].current = 0; }
+        }
+
+        shard = 0;
+        slots = allSlots[0];
+        setFileNames();
+
+        if (not found and DB_SHARDS == 1) { convertStatusFiles(); }
+    }
+
+    inline void UpdateDBManager::saveSlots() {
+        setFileNames();
+        allSlots[shard] = slots;
+        saveNVSBlob("dbslots", allSlots, sizeof(allSlots));
+    }
+
+    // Must not be called in the middle of a download
+    inline void UpdateDBManager::selectShard(int shard) {
+        if (shard < 0 or shard >= DB_SHARDS) { return; }
+        allSlots[this->shard] = slots;
+        this->shard = shard;
+        slots = allSlots[shard];
+        setFileNames();
+    }
+
+    // Returns a bitmask of the shards we need to download: the ones
+    // whose digest in the manifest differs from the one of our current
+    // file and the ones we have no valid file for.
+    inline uint32_t UpdateDBManager::checkShardManifest(const char* data,
+                                                        int data_len) {
+
+        DBShardManifestHeader header;
+        if (data_len < (int) sizeof(header)) {
+            log_e("Invalid DB shard manifest");
+            return 0;
+        }
+        memcpy(&header, data, sizeof(header));
+
+        if (memcmp(header.magic, DB_SHARD_MANIFEST_MAGIC, 8)) {
+            log_e("Invalid DB shard manifest");
+            return 0;
+        } else if (header.shards != DB_SHARDS) {
+            log_e("The server has %u DB shards, but we use %d",
+                  header.shards, DB_SHARDS);
+            return 0;
+        } else if (data_len != (int) sizeof(header) + DB_SHARDS * HASH_SIZE) {
+            log_e("Invalid DB shard manifest");
+            return 0;
+        }
+
+        const uint8_t* digests = (const uint8_t*) data + sizeof(header);
+        uint32_t stale = 0;
+        for (int k = 0; k < DB_SHARDS; ++k) {
+            selectShard(k);
+            if (not isValid(slots.current) or memcmp(shardDigests[k],
+                                     digests + k * HASH_SIZE, HASH_SIZE)) {
+                stale |= 1 << k;
+            }
+        }
+        selectShard(0);
+
+        // Until we have all of these, the flat index does not match
+        manifestVersion = header.version;
+        pendingShards = stale;
+        setShardsVersion(stale == 0 ? header.version : 0);
+
+        log_i("DB shard manifest: %d shards, version %u, stale ones: 0x%x",
+              DB_SHARDS, header.version, stale);
+        return stale;
+    }
+
+    inline void UpdateDBManager::setShardsVersion(uint32_t version) {
+        if (version != shardsVersion) {
+            shardsVersion = version;
+            saveNVSBlob("shardversion", &shardsVersion,
+                        sizeof(shardsVersion));
+        }
+        setDBShardsVersion(version);
+    }
+
+    inline void UpdateDBManager::convertStatusFiles() {
+        const char* validFiles[2] = { "/VALID_A.TXT", "/VALID_B.TXT" };
+        const char* preferredFiles[2] = { "/PREF_A.TXT", "/PREF_B.TXT" };
+
+        slots.valid = 0;
+        for (int i = 0; i < 2; ++i) {
+            if (checkIf(validFiles[i])) { slots.valid |= 1 << i; }
+        }
+
+        // If both are valid and both are preferred (we crashed in the
+        // middle of a swap), we use DB_A, just like before
+        slots.current = 0;
+        if (isValid(1) and (not isValid(0) or (checkIf(preferredFiles[1])
+                                    and not checkIf(preferredFiles[0])))) {
+            slots.current = 1;
+        }
+
+        saveSlots();
+        log_i("Converting DB status files (valid: %d, current: %s)",
+              slots.valid, currentFile);
+
+        for (int i = 0; i < 2; ++i) {
+            if (DISK.exists(validFiles[i])) { DISK.remove(validFiles[i]); }
+            if (DISK.exists(preferredFiles[i])) {
+                DISK.remove(preferredFiles[i]);
+            }
+        }
+    }
+
+    bool UpdateDBManager::checkIf(const char *filename) {
+        // In some exceptional circumstances, we might end up writing
+        // "1" to the file more than once; that's ok, 11 > 0 too :) .
+
+        if (!DISK.exists(filename)) { return false; }
+        File f = DISK.open(filename);
+        if (!f) { return false; }
+
+        int t = 0;
+        if (f.available()) {
+            t = f.parseInt(); // If reading fails, this returns 0
+        }
+        f.close();
+        return t > 0;
+    }
+
+    inline bool UpdateDBManager::findPreferredDB() {
+        if (isValid(slots.current)) { return true; }
+        return swapFiles();
+    }
+
+    inline void UpdateDBManager::clearCurrentDBFile() {
+        if (DISK.exists(currentFile)) { DISK.remove(currentFile); };
+        setValid(slots.current, false);
+    }
+
+    // Besides the files, we forget the partial download and the digests,
+    // or the next manifest would tell us that we do not need a new DB
+    inline bool UpdateDBManager::wipeFiles() {
+        log_i("Wiping all DB files");
+        closeDB();
+
+        // No DB file is valid anymore
+        memset(allSlots, 0, sizeof(allSlots));
+        slots = allSlots[shard];
+        saveSlots();
+
+        resetCursor();
+        forgetCurrentDBDigest();
+        forgetVersionAlias();
+        if (DB_SHARDS > 1) {
+            memset(shardDigests, 0, sizeof(shardDigests));
+            saveNVSBlob("sharddigests", shardDigests, sizeof(shardDigests));
+
+            // Without shards, the flat index is all we have, so we keep it
+            pendingShards = 0;
+            shardsVersion = 0;
+            saveNVSBlob("shardversion", &shardsVersion,
+                        sizeof(shardsVersion));
+        }
+
+        bool ok = true;
+        for (int k = 0; k < DB_SHARDS; ++k) {
+            for (int i = 0; i < 2; ++i) {
+                char name[16];
+                dbFileName(k, i, name, sizeof(name));
+                if (DB_SHARDS > 1 and not DISK.exists(name)) { continue; }
+                if (not DISK.remove(name)) {
+                    log_w("Something wrong happened while removing "
+                          "DB file %s", name);
+                    ok = false;
+                }
+            }
+        }
+
+        return ok;
+    }
+
+
+    UpdateDBManager updateDBManager;
+
+
+    // The flat index (check flatindex.cpp) is downloaded just like the
+    // DB, but it is written directly to its own flash partition. There is
+    // no room for two copies, so while we write the new one the Authorizer
+    // stops using the flat index and queries SQLite instead. We write the
+    // header only after everything else is written and checked, so an
+    // interrupted download leaves us with an invalid (ignored) index.
+    //
+    // The index is a retained message, so we receive it again every time
+    // we boot; if the header (which includes the CRC of the contents) is
+    // the same as the one we already have, we skip the download instead
+    // of rewriting the flash.
+    class FlatIndexUpdater {
+    public:
+        inline ssize_t writeToFlatIndex(const char* data, int data_len);
+        inline void finishFlatIndexDownload();
+        inline void cancelFlatIndexDownload();
+
+    private:
+        bool downloading = false;
+        bool skipping = false;
+        bool failed = false;
+        bool closedIndex = false;
+
+        const esp_partition_t* partition;
+        FlatIndexHeader header;
+        size_t received;
+        size_t expected;
+        size_t erasedUpTo;
+
+        inline bool startFlatIndexDownload();
+        inline void processHeader();
+        inline bool eraseUpTo(size_t end);
+        inline bool writeRecords(const char* data, int data_len);
+        inline bool recordsAreOK();
+    };
+
+    inline bool FlatIndexUpdater::startFlatIndexDownload() {
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                             ESP_PARTITION_SUBTYPE_ANY,
+                                             FLAT_INDEX_PARTITION);
+
+        if (partition == NULL) {
+            log_w("No flat index partition, ignoring flat index");
+            return false;
+        }
+
+        log_d("Starting flat index download");
+        downloading = true;
+        skipping = false;
+        failed = false;
+        closedIndex = false;
+        received = 0;
+        expected = sizeof(header);
+        erasedUpTo = 0;
+        return true;
+    }
+
+    inline void FlatIndexUpdater::processHeader() {
+        if (not flatIndexHeaderIsValid(&header, partition->size)) {
+            log_w("Invalid flat index header, ignoring flat index");
+            failed = true;
+            return;
+        }
+
+        expected = sizeof(header) + header.bodySize;
+
+        FlatIndexHeader current;
+        esp_partition_read(partition, 0, &current, sizeof(current));
+        if (0 == memcmp(&current, &header, sizeof(header))) {
+            log_i("Flat index did not change, skipping download");
+            skipping = true;
+            return;
+        }
+
+        // We are about to erase the partition
+        closeFlatIndex();
+        closedIndex = true;
+
+        // The header is written at the end, even if there are no records
+        // (a door with no authorized users), so its sector must be erased
+        // even if writeRecords() is never called
+        if (not eraseUpTo(sizeof(header))) { failed = true; }
+    }
+
+    inline bool FlatIndexUpdater::eraseUpTo(size_t end) {
+        while (erasedUpTo < end) {
+            esp_err_t err = esp_partition_erase_range(partition, erasedUpTo,
+                                                      SPI_FLASH_SEC_SIZE);
+            if (err != ESP_OK) {
+                log_w("Error (%s) erasing flat index partition",
+                      esp_err_to_name(err));
+                return false;
+            }
+            erasedUpTo += SPI_FLASH_SEC_SIZE;
+        }
+
+        return true;
+    }
+
+    inline bool FlatIndexUpdater::writeRecords(const char* data,
+                                               int data_len) {
+
+        if (received + data_len > expected) {
+            log_w("Flat index is larger than announced");
+            return false;
+        }
+
+        if (not eraseUpTo(received + data_len)) { return false; }
+
+        esp_err_t err = esp_partition_write(partition, received,
+                                            data, data_len);
+        if (err != ESP_OK) {
+            log_w("Error (%s) writing flat index", esp_err_to_name(err));
+            return false;
+        }
+
+        return true;
+    }
+
+    inline ssize_t FlatIndexUpdater::writeToFlatIndex(const char* data,
+                                                      int data_len) {
+
+        if (not downloading and not startFlatIndexDownload()) { return -1; }
+
+        if (skipping or failed) { return data_len; }
+
+        int consumed = 0;
+        if (received < sizeof(header)) {
+            consumed = sizeof(header) - received;
+            if (consumed > data_len) { consumed = data_len; }
+            memcpy((char*) &header + received, data, consumed);
+            received += consumed;
+
+            if (received < sizeof(header)) { return data_len; }
+
+            processHeader();
+            if (skipping or failed) { return data_len; }
+        }
+
+        if (not writeRecords(data + consumed, data_len - consumed)) {
+            failed = true;
+            return -1;
+        }
+
+        received += data_len - consumed;
+        return data_len;
+    }
+
+    inline bool FlatIndexUpdater::recordsAreOK() {
+        static uint8_t buf[256];
+        uint32_t crc = 0;
+        for (size_t pos = sizeof(header); pos < expected; pos += sizeof(buf)) {
+            size_t len = expected - pos;
+            if (len > sizeof(buf)) { len = sizeof(buf); }
+            if (esp_partition_read(partition, pos, buf, len) != ESP_OK) {
+                return false;
+            }
+            crc = esp_crc32_le(crc, buf, len);
+        }
+
+        return crc == header.crc;
+    }
+
+    inline void FlatIndexUpdater::finishFlatIndexDownload() {
+        if (not downloading) { return; }
+        downloading = false;
+
+        if (skipping) { return; }
+
+        if (failed or received != expected) {
+            log_w("Flat index download failed");
+        } else if (not recordsAreOK()) {
+            log_w("Flat index download is corrupted, discarding");
+        } else if (esp_partition_write(partition, 0, &header,
+                                       sizeof(header)) != ESP_OK) {
+            log_w("Error writing flat index header");
+        } else {
+            log_d("Finished flat index download");
+        }
+
+        if (closedIndex) { openFlatIndex(); }
+    }
+
+    inline void FlatIndexUpdater::cancelFlatIndexDownload() {
+        if (not downloading) { return; }
+        downloading = false;
+        log_i("Flat index download cancelled");
+
+        // The header was not written, so the partition is not valid
+        // anymore; this makes the Authorizer aware of that.
+        if (closedIndex) { openFlatIndex(); }
+    }
+
+    FlatIndexUpdater flatIndexUpdater;
+}
+
+void initDBMan() { DBNS::updateDBManager.init(); }
+
+ssize_t writeToDatabaseFile(const char* data, int data_len) {
+    return DBNS::updateDBManager.writeToDatabaseFile(data, data_len);
+}
+
+void finishDBDownload() { return DBNS::updateDBManager.finishDBDownload(); }
+
+void cancelDBDownload() { return DBNS::updateDBManager.cancelDBDownload(); }
+
+ssize_t writeToDBDelta(const char* data, int data_len) {
+    return DBNS::updateDBManager.writeToDBDelta(data, data_len);
+}
+
+void finishDBDelta() { DBNS::updateDBManager.finishDBDelta(); }
+
+void cancelDBDelta() { DBNS::updateDBManager.cancelDBDelta(); }
+
+ssize_t writeToDBChunk(const char* data, int data_len) {
+    return DBNS::updateDBManager.writeToDBChunk(data, data_len);
+}
+
+bool finishDBChunk() { return DBNS::updateDBManager.finishDBChunk(); }
+
+void cancelDBChunk() { DBNS::updateDBManager.cancelDBChunk(); }
+
+unsigned int nextDBChunk() { return DBNS::updateDBManager.nextDBChunk(); }
+
+bool checkDBManifest(const char* data, int data_len) {
+    return DBNS::updateDBManager.checkDBManifest(data, data_len);
+}
+
+void selectDBShard(int shard) { DBNS::updateDBManager.selectShard(shard); }
+
+uint32_t checkDBShardManifest(const char* data, int data_len) {
+    return DBNS::updateDBManager.checkShardManifest(data, data_len);
+}
+
+ssize_t writeToFlatIndex(const char* data, int data_len) {
+    return DBNS::flatIndexUpdater.writeToFlatIndex(data, data_len);
+}
+
+void finishFlatIndexDownload() {
+    DBNS::flatIndexUpdater.finishFlatIndexDownload();
+}
+
+void cancelFlatIndexDownload() {
+    DBNS::flatIndexUpdater.cancelFlatIndexDownload();
+}
+
+bool wipeDBFiles() { return DBNS::updateDBManager.wipeFiles(); }
@@ -32,8 +32,7 @@ unsigned long int cardID;
 void checkDoor() {
     if (checkCardReaders(readerID, cardID)) {
         char cardHash[65]; // 64 chars + '\0'
-        calculate_hash(cardID, cardHash);
-        bool authorized = userAuthorized(readerID, cardHash);
+        bool authorized = cardAuthorized(readerID, cardID, cardHash);
         logAccess(readerID, cardHash, authorized);
         if (authorized) {
             openDoor(readerID);
@@ -0,0 +1,209 @@
+static const char *TAG = "flatidx";
+
+#include <tramela.h>
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <esp_crc.h>
+#include <flatindex.h>
+#include <authindex.h> // HASH_SIZE
+
+/*
+  For sites with many users, the SQLite DB is too large to fit in RAM and
+  each query may need to read a few pages through FATFS, which is slow.
+  As an alternative, the server may also publish a "flat index" for each
+  door: a header plus the sorted list of hashes authorized for that door.
+  We write it to a dedicated flash partition (check dbmanager.cpp) and
+  read it here via esp_partition_mmap(), so a lookup is simply a binary
+  search over memory-mapped flash: there is no filesystem involved and
+  no page cache in the heap (the flash cache does that for us).
+
+  Binary search over 100k+ users still means about 17 random reads from
+  flash, so the server may instead send a perfect hash table, which
+  answers each query with 2 reads. This is "hash and displace" (CHD,
+  Belazzougui et al.), simplified because our keys are SHA-256 digests,
+  so we may use their bits directly instead of hashing them again:
+
+  * bytes 0-3 of the digest choose a bucket b;
+  * each bucket has a 16-bit "pilot" p, chosen by the server so that
+    the keys of all buckets land in different slots, with
+    slot = (k XOR (p * MPH_PILOT_MULTIPLIER)) mod numSlots, where k is
+    bytes 4-11 of the digest as a 64-bit integer (the multiplication
+    "spreads" the bits of the pilot, so each pilot sends each key to an
+    essentially random slot);
+  * each slot holds a fingerprint (bytes 12-19 of the digest) of the
+    key that landed there, or zeros if the slot is empty.
+
+  The server uses a load factor slightly below 1 (numSlots > count),
+  which makes building the table much faster. A card that is not
+  authorized is accepted only if its fingerprint matches that of the
+  key in its slot: with 64-bit fingerprints, the probability of this
+  is 2^-64, negligible compared to other ways of forging a card.
+
+  If the header is not valid (for example, because the partition is
+  empty or because we were interrupted while writing to it), we do not
+  use the flat index at all and the Authorizer uses SQLite instead.
+
+  The index is opened and closed by the task that updates it (check
+  dbmanager.cpp) while cards are looked up by another one, so lookups
+  and the switch of "body" happen with "lock" held: close() never
+  unmaps the partition in the middle of a lookup. The slow part of
+  open() (mapping the partition and checking the CRC) happens with
+  "body" still NULL, so it does not need the lock.
+*/
+
+bool flatIndexHeaderIsValid(const FlatIndexHeader* header,
+                            size_t partitionSize) {
+
+    bool sorted = !memcmp(header->magic, FLAT_INDEX_MAGIC, 8);
+    bool perfectHash = !memcmp(header->magic, MPH_INDEX_MAGIC, 8);
+    if (not sorted and not perfectHash) { return false; }
+
+    if (header->recordSize != (sorted ? HASH_SIZE : MPH_FINGERPRINT_SIZE)) {
+        log_w("Flat index has an invalid record size (%u)",
+              header->recordSize);
+        return false;
+    }
+
+    if (sorted and header->bodySize != header->count * HASH_SIZE) {
+        log_w("Flat index has an invalid size");
+        return false;
+    }
+
+    if (header->doorID != doorID) {
+        log_w("Flat index is for door %u, not for us", header->doorID);
+        return false;
+    }
+
+    if (header->bodySize > partitionSize - sizeof(FlatIndexHeader)) {
+        log_w("Flat index is larger than the partition");
+        return false;
+    }
+
+    return true;
+}
+
+bool FlatIndex::open() {
+    if (lock == NULL) { lock = xSemaphoreCreateMutex(); }
+    close();
+
+    const esp_partition_t* partition = esp_partition_find_first(
+                                            ESP_PARTITION_TYPE_DATA,
+                                            ESP_PARTITION_SUBTYPE_ANY,
+                                            FLAT_INDEX_PARTITION);
+
+    if (partition == NULL) {
+        log_d("No flat index partition available");
+        return false;
+    }
+
+    esp_partition_read(partition, 0, &header, sizeof(header));
+    if (not flatIndexHeaderIsValid(&header, partition->size)) {
+        log_d("No valid flat index available");
+        return false;
+    }
+
+    size_t size = sizeof(header) + header.bodySize;
+    const void* mapped;
+    esp_err_t err = esp_partition_mmap(partition, 0, size,
+                                       SPI_FLASH_MMAP_DATA,
+                                       &mapped, &mmapHandle);
+
+    if (err != ESP_OK) {
+        log_w("Error (%s) mapping flat index", esp_err_to_name(err));
+        return false;
+    }
+
+    const uint8_t* data = (const uint8_t*) mapped + sizeof(header);
+    uint32_t crc = esp_crc32_le(0, data, header.bodySize);
+    if (crc != header.crc) {
+        log_w("Flat index is corrupted, ignoring it");
+        spi_flash_munmap(mmapHandle);
+        return false;
+    }
+
+    perfectHash = !memcmp(header.magic, MPH_INDEX_MAGIC, 8);
+    if (perfectHash) {
+        memcpy(&mphHeader, data, sizeof(mphHeader));
+        pilots = (const uint16_t*) (data + sizeof(mphHeader));
+        size_t pilotsSize = (mphHeader.numBuckets * 2 + 3) & ~3;
+        fingerprints = data + sizeof(mphHeader) + pilotsSize;
+        size_t needed = sizeof(mphHeader) + pilotsSize
+                            + mphHeader.numSlots * MPH_FINGERPRINT_SIZE;
+
+        if (mphHeader.numSlots == 0 or mphHeader.numBuckets == 0
+                                    or needed != header.bodySize) {
+            log_w("Perfect hash index has an invalid size, ignoring it");
+            spi_flash_munmap(mmapHandle);
+            return false;
+        }
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    body = data;
+    xSemaphoreGive(lock);
+
+    log_i("Flat index available (%s): %u hashes for door %u "
+          "(DB version %u), %u bytes", perfectHash ? "perfect hash"
+                                                   : "sorted",
+          header.count, header.doorID, header.dbVersion, header.bodySize);
+
+    return true;
+}
+
+void FlatIndex::close() {
+    if (lock == NULL) { return; } // never opened
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    const uint8_t* data = body;
+    body = NULL;
+    xSemaphoreGive(lock);
+
+    if (data != NULL) { spi_flash_munmap(mmapHandle); }
+}
+
+bool FlatIndex::lookup(const uint8_t* binHash, bool& found) {
+    if (lock == NULL) { return false; }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    const uint8_t* data = body;
+    if (data != NULL) {
+        found = perfectHash ? perfectHashContains(binHash)
+                            : sortedContains(data, binHash);
+    }
+    xSemaphoreGive(lock);
+
+    return data != NULL;
+}
+
+// Fractional part of the golden ratio, as usual for multiplicative hashing
+#define MPH_PILOT_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+bool FlatIndex::perfectHashContains(const uint8_t* binHash) {
+    uint32_t b;
+    uint64_t k;
+    memcpy(&b, binHash, 4);
+    memcpy(&k, binHash +4, 8);
+
+    uint64_t pilot = pilots[b % mphHeader.numBuckets];
+    uint32_t slot = (k ^ (pilot * MPH_PILOT_MULTIPLIER)) % mphHeader.numSlots;
+
+    return 0 == memcmp(fingerprints + slot * MPH_FINGERPRINT_SIZE,
+                       binHash +12, MPH_FINGERPRINT_SIZE);
+}
+
+bool FlatIndex::sortedContains(const uint8_t* data, const uint8_t* binHash) {
+    size_t low = 0;
+    size_t high = header.count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = memcmp(data + mid * HASH_SIZE, binHash, HASH_SIZE);
+        if (cmp == 0) { return true; }
+        if (cmp < 0) {
+            low = mid +1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return false;
+}
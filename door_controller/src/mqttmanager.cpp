@@ -13,20 +13,40 @@ static const char *TAG = "mqttman";
 #include <keys.h>
 #include <firmwareOTA.h>
 #include <logmanager.h>
+#include <authorizer.h> // logAuthStats()
 
 // Everytime we successfully connect to the broker (which happens on boot
 // but also at other times due to network failures), we subscribe to the
-// "firmware" and "commands" topics, as this is harmless (the previous
-// subscription is dropped by the broker). However, we do not want to do
-// that with the "database" topic, because when we subscribe we receive
-// the DB file again (it is a retained message). So, we keep track of
-// whether we have already subscribed at boot and only resubscribe if
-// something fails and we want to download a fresh DB. This means we
-// always receive a copy of the DB on boot (when we first subscribe),
-// even if it is not necessary, but that is harmless.
+// "firmware", "commands", "dbdelta" and "dbmanifest" topics, as this is
+// harmless (the previous subscription is dropped by the broker). However,
+// we do not want to do that with the "dbchunk" topics, because when we
+// subscribe we receive the DB chunk again (it is a retained message). So,
+// we only subscribe to them, one at a time, when we need a full DB and
+// unsubscribe after the download; changes to the DB arrive as deltas
+// (check dbmanager.cpp). On boot (and after reconnecting in the middle of
+// a download), we first check the manifest (also retained), which tells
+// us whether the DB we have is outdated; if something fails, such as
+// missing some DB delta, we subscribe to the chunks right away. A download
+// interrupted by a disconnection continues from the chunk where it
+// stopped. We also subscribe to the "authindex" topic only once, but in
+// that case we do not even need the disk.
+//
+// With DB_SHARDS > 1 (check authorizer.h), there are no chunks or deltas:
+// we subscribe to "dbshardmanifest" instead (also retained), which has
+// the digest of each shard, and then to "dbshard/<k>" for each shard
+// that changed, unsubscribing from it after the download.
+//
+// With DB_PER_DOOR, we do the same as without it, but the DB is a slice
+// with only what this door needs (check poc_manager/dbslice.py) and the
+// topics are "/topic/door/<doorID>/dbdelta" etc. instead.
+
+#if defined(DB_PER_DOOR) and DB_SHARDS > 1
+#error "DB_PER_DOOR and DB_SHARDS > 1 cannot be used together"
+#endif
 
 namespace  MQTT {
-    enum DownloadType { DB, FIRMWARE, NONE };
+    enum DownloadType { DB, DBCHUNK, DBDELTA, DBSHARD, FIRMWARE, AUTHINDEX,
+                        NONE };
 
     // This is a "real" function (not a method) that hands
     // the received event over to the MqttManager object.
@@ -45,7 +65,21 @@ namespace  MQTT {
     private: 
         enum DownloadType downloading; // DB, FIRMWARE, or NONE
         bool connected = false;
-        bool subscribed = false;
+        bool subscribed = false; // to the "dbchunk" topic
+        char deltaTopic[40];    // "/topic/dbdelta" or, with DB_PER_DOOR,
+        char manifestTopic[40]; // "/topic/door/<doorID>/dbdelta" etc.
+        char chunkPrefix[40];
+        char chunkTopic[50] = ""; // "<chunkPrefix><chunk>"
+        bool needDB = true; // we want to download the full DB
+        inline void subscribeToNextChunk();
+        void finishedDBDownload();
+        void finishedDBChunk();
+        uint32_t shardsSubscribed = 0; // bit k: "/topic/dbshard/<k>"
+        int shardDownloading;
+        inline void subscribeToShards(uint32_t shards);
+        void finishedDBShard();
+        bool indexSubscribed = false;
+        char indexTopic[30]; // "/topic/authindex/<doorID>"
         bool diskOK = false;
 
         // We should never have more than one message in transit at any
@@ -81,6 +115,17 @@ namespace  MQTT {
 
         char buffer[50]; 
         snprintf(buffer, 50, "ESP_KEYLOCK_ID-%d", doorID);
+        snprintf(indexTopic, 30, "/topic/authindex/%d", doorID);
+
+        char prefix[30];
+#       ifdef DB_PER_DOOR
+        snprintf(prefix, 30, "/topic/door/%d/", doorID);
+#       else
+        snprintf(prefix, 30, "/topic/");
+#       endif
+        snprintf(deltaTopic, 40, "%sdbdelta", prefix);
+        snprintf(manifestTopic, 40, "%sdbmanifest", prefix);
+        snprintf(chunkPrefix, 40, "%sdbchunk/", prefix);
 
         const esp_mqtt_client_config_t mqtt_cfg = {
             .host = "mosquito.ime.usp.br",
@@ -179,6 +224,18 @@ namespace  MQTT {
                 } else {
                     log_i("Ignoring received command to rotate the logs.");
                 }
+            } else if (!strcmp(actualCommand, "authStats")) {
+                log_i("Received command to log authorizer stats.");
+                logAuthStats();
+            } else if (!strcmp(actualCommand, "benchHash")) {
+                log_i("Received command to benchmark card hashing.");
+                benchmarkHash();
+            } else if (!strcmp(actualCommand, "benchDB")) {
+                log_i("Received command to benchmark DB lookups.");
+                benchmarkDB();
+            } else if (!strcmp(actualCommand, "benchCache")) {
+                log_i("Received command to benchmark the DB page cache.");
+                benchmarkDBCache();
             } else {
                 log_e("Unknown command: %s", actualCommand);
             }
@@ -186,12 +243,89 @@ namespace  MQTT {
     }
 
     inline void MqttManager::resubscribe() {
-        if (not subscribed) { return; }
-        if (downloading == DB) { return; }
+        needDB = true;
+        // check finishedDBDownload(), finishedDBChunk() and finishedDBShard()
+        if (downloading == DB or downloading == DBCHUNK
+                or downloading == DBSHARD) { return; }
         if (not diskOK) { return; }
-        if (serverConnected()) {
-            esp_mqtt_client_subscribe(client, "/topic/database", 2);
+        if (DB_SHARDS > 1) {
+            // We receive the manifest again and download what we need
+            if (serverConnected()) {
+                esp_mqtt_client_subscribe(client, "/topic/dbshardmanifest", 2);
+            }
+        } else if (serverConnected()) {
+            subscribeToNextChunk();
         } else {
+            subscribed = false; // we subscribe again when we reconnect
+        }
+    }
+
+    // Each shard is a retained message on its own topic, in the same
+    // format as the full DB (check writeToDatabaseFile() in dbmanager.cpp)
+    inline void MqttManager::subscribeToShards(uint32_t shards) {
+        for (int k = 0; k < DB_SHARDS; ++k) {
+            uint32_t bit = 1 << k;
+            if (not (shards & bit) or (shardsSubscribed & bit)) { continue; }
+
+            char topic[30];
+            snprintf(topic, 30, "/topic/dbshard/%d", k);
+            if (esp_mqtt_client_subscribe(client, topic, 2) > 0) {
+                shardsSubscribed |= bit;
+            }
+        }
+    }
+
+    // Same as finishedDBDownload(), after downloading a shard
+    void MqttManager::finishedDBShard() {
+        downloading = NONE;
+
+        char topic[30];
+        snprintf(topic, 30, "/topic/dbshard/%d", shardDownloading);
+        esp_mqtt_client_unsubscribe(client, topic);
+        shardsSubscribed &= ~(1 << shardDownloading);
+
+        if (needDB) { resubscribe(); }
+    }
+
+    // The full DB is split in chunks, each one a retained message on its
+    // own topic, and we subscribe to one at a time: the one the DB manager
+    // needs next (check writeToDBChunk() in dbmanager.cpp).
+    inline void MqttManager::subscribeToNextChunk() {
+        char topic[50];
+        snprintf(topic, 50, "%s%u", chunkPrefix, nextDBChunk());
+
+        if (chunkTopic[0] != 0 and strcmp(topic, chunkTopic)) {
+            esp_mqtt_client_unsubscribe(client, chunkTopic);
+        }
+        strcpy(chunkTopic, topic);
+
+        // If we were already subscribed, this makes
+        // the broker send the retained message again
+        subscribed = esp_mqtt_client_subscribe(client, chunkTopic, 2) > 0;
+    }
+
+    // Called after finishDBDownload(), which may have failed and
+    // called forceDBDownload() (and, therefore, resubscribe()). Older
+    // versions downloaded the whole DB from "/topic/database"; with a
+    // persistent session, we may still be subscribed to it.
+    void MqttManager::finishedDBDownload() {
+        downloading = NONE;
+        esp_mqtt_client_unsubscribe(client, "/topic/database");
+        if (needDB) {
+            resubscribe();
+        } else if (subscribed) {
+            esp_mqtt_client_unsubscribe(client, chunkTopic);
+            subscribed = false;
+        }
+    }
+
+    // Same as above, after finishDBChunk()
+    void MqttManager::finishedDBChunk() {
+        downloading = NONE;
+        if (needDB) {
+            resubscribe();
+        } else if (subscribed) {
+            esp_mqtt_client_unsubscribe(client, chunkTopic);
             subscribed = false;
         }
     }
@@ -209,12 +343,20 @@ namespace  MQTT {
             connected = true;
             esp_mqtt_client_subscribe(client, "/topic/commands", 2);
             esp_mqtt_client_subscribe(client, "/topic/firmware", 2);
-            if (diskOK and not subscribed) {
-                // Re-downloads the DB, because it is a retained message
-                if (esp_mqtt_client_subscribe(client,
-                                              "/topic/database", 2) > 0) {
-
-                    subscribed = true;
+            if (diskOK and DB_SHARDS > 1) {
+                // Retained; we download the shards that changed
+                esp_mqtt_client_subscribe(client, "/topic/dbshardmanifest", 2);
+            } else if (diskOK) {
+                // Retained, so we get the latest delta every time
+                esp_mqtt_client_subscribe(client, deltaTopic, 2);
+                // Also retained; if needDB, we check it before
+                // downloading (or continuing to download) the DB
+                esp_mqtt_client_subscribe(client, manifestTopic, 2);
+            }
+            if (not indexSubscribed) {
+                // Also a retained message
+                if (esp_mqtt_client_subscribe(client, indexTopic, 2) > 0) {
+                    indexSubscribed = true;
                 }
             }
 
@@ -225,9 +367,20 @@ namespace  MQTT {
             connected = false;
             log_i("MQTT_EVENT_DISCONNECTED");
             cancelDBDownload();
+            cancelDBChunk();
+            cancelDBDelta();
+            cancelFlatIndexDownload();
             cancelLogUpload();
             cancelFirmwareDownload();
             resetMessageList();
+            if (downloading == DB or downloading == DBCHUNK
+                    or downloading == DBSHARD) {
+                downloading = NONE;
+            }
+            if (needDB) {
+                subscribed = false; // check the manifest when we reconnect
+            }
+            shardsSubscribed = 0; // same here
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
@@ -258,6 +411,29 @@ namespace  MQTT {
                 break;
             }
 
+            // The manifest is also small
+            if (!strcmp(buffer, manifestTopic)) {
+                log_i("MQTT_EVENT_DATA from topic %s", buffer);
+                if (diskOK and needDB and not subscribed) {
+                    if (checkDBManifest(event->data, event->data_len)) {
+                        needDB = false;
+                    } else {
+                        subscribeToNextChunk();
+                    }
+                }
+                break;
+            }
+
+            if (!strcmp(buffer, "/topic/dbshardmanifest")) {
+                log_i("MQTT_EVENT_DATA from topic %s", buffer);
+                if (diskOK) {
+                    needDB = false;
+                    subscribeToShards(checkDBShardManifest(event->data,
+                                                           event->data_len));
+                }
+                break;
+            }
+
             // File downloads are normally split into multiple "slices",
             // so they result in multiple events; when this happens, the
             // topic is only present in the first one, so we need to
@@ -272,10 +448,36 @@ namespace  MQTT {
                     log_i("MQTT_EVENT_DATA from /topic/firmware -- full message");
                     writeToFirmwareFile(event->data, event->data_len);
                     performFirmwareUpdate();
+                } else if (!strcmp(buffer, indexTopic)) {
+                    log_i("MQTT_EVENT_DATA from %s -- full message", indexTopic);
+                    writeToFlatIndex(event->data, event->data_len);
+                    finishFlatIndexDownload();
+                } else if (!strcmp(buffer, deltaTopic)) {
+                    log_i("MQTT_EVENT_DATA from %s -- full message", buffer);
+                    writeToDBDelta(event->data, event->data_len);
+                    finishDBDelta();
+                } else if (!strncmp(buffer, chunkPrefix, strlen(chunkPrefix))) {
+                    log_i("MQTT_EVENT_DATA from %s -- full message", buffer);
+                    needDB = false;
+                    downloading = DBCHUNK;
+                    writeToDBChunk(event->data, event->data_len);
+                    if (not finishDBChunk()) { needDB = true; }
+                    finishedDBChunk();
+                } else if (!strncmp(buffer, "/topic/dbshard/", 15)) {
+                    log_i("MQTT_EVENT_DATA from %s -- full message", buffer);
+                    downloading = DBSHARD;
+                    shardDownloading = atoi(buffer + 15);
+                    selectDBShard(shardDownloading);
+                    writeToDatabaseFile(event->data, event->data_len);
+                    finishDBDownload();
+                    finishedDBShard();
                 } else if (diskOK) {
                     log_i("MQTT_EVENT_DATA from /topic/database -- full message");
+                    needDB = false;
+                    downloading = DB;
                     writeToDatabaseFile(event->data, event->data_len);
                     finishDBDownload();
+                    finishedDBDownload();
                 } else { } // shouldn't happen, not subscribed to the DB topic
 
                 break;
@@ -287,6 +489,20 @@ namespace  MQTT {
                 if (!strcmp(buffer, "/topic/firmware")) {
                     downloading = FIRMWARE;
                     log_i("MQTT_EVENT_DATA from /topic/firmware -- first");
+                } else if (!strcmp(buffer, indexTopic)) {
+                    downloading = AUTHINDEX;
+                    log_i("MQTT_EVENT_DATA from %s -- first", indexTopic);
+                } else if (!strcmp(buffer, deltaTopic)) {
+                    downloading = DBDELTA;
+                    log_i("MQTT_EVENT_DATA from %s -- first", buffer);
+                } else if (!strncmp(buffer, chunkPrefix, strlen(chunkPrefix))) {
+                    downloading = DBCHUNK;
+                    log_i("MQTT_EVENT_DATA from %s -- first", buffer);
+                } else if (!strncmp(buffer, "/topic/dbshard/", 15)) {
+                    downloading = DBSHARD;
+                    shardDownloading = atoi(buffer + 15);
+                    selectDBShard(shardDownloading);
+                    log_i("MQTT_EVENT_DATA from %s -- first", buffer);
                 } else if (diskOK) {
                     downloading = DB;
                     log_i("MQTT_EVENT_DATA from /topic/database -- first");
@@ -311,13 +527,57 @@ namespace  MQTT {
                     log_v("MQTT_EVENT_DATA from /topic/firmware -- ongoing %d",
                             event->current_data_offset);
                 }
+            } else if (downloading == AUTHINDEX) {
+                writeToFlatIndex(event->data, event->data_len);
+                if (lastSlice) {
+                    log_i("MQTT_EVENT_DATA from %s -- last", indexTopic);
+                    finishFlatIndexDownload();
+                    downloading = NONE;
+                    forgetMessage(event->msg_id);
+                } else {
+                    log_v("MQTT_EVENT_DATA from %s -- ongoing %d",
+                            indexTopic, event->current_data_offset);
+                }
+            } else if (downloading == DBDELTA) {
+                writeToDBDelta(event->data, event->data_len);
+                if (lastSlice) {
+                    log_i("MQTT_EVENT_DATA from %s -- last", deltaTopic);
+                    finishDBDelta();
+                    downloading = NONE;
+                    forgetMessage(event->msg_id);
+                }
+            } else if (downloading == DBCHUNK) {
+                writeToDBChunk(event->data, event->data_len);
+                if (lastSlice) {
+                    log_i("MQTT_EVENT_DATA from %s -- last", chunkTopic);
+                    needDB = false;
+                    if (not finishDBChunk()) { needDB = true; }
+                    finishedDBChunk();
+                    forgetMessage(event->msg_id);
+                } else {
+                    log_v("MQTT_EVENT_DATA from %s -- ongoing %d",
+                            chunkTopic, event->current_data_offset);
+                }
+            } else if (downloading == DBSHARD) {
+                writeToDatabaseFile(event->data, event->data_len);
+                if (lastSlice) {
+                    log_i("MQTT_EVENT_DATA from /topic/dbshard/%d -- last",
+                          shardDownloading);
+                    finishDBDownload();
+                    finishedDBShard();
+                    forgetMessage(event->msg_id);
+                } else {
+                    log_v("MQTT_EVENT_DATA from /topic/dbshard/%d -- ongoing %d",
+                            shardDownloading, event->current_data_offset);
+                }
             } else if (diskOK) {
                 writeToDatabaseFile(event->data, event->data_len);
                 if (lastSlice) {
                     log_i("MQTT_EVENT_DATA from /topic/database -- last");
 
+                    needDB = false;
                     finishDBDownload();
-                    downloading = NONE;
+                    finishedDBDownload();
                     forgetMessage(event->msg_id);
                 } else {
                     log_v("MQTT_EVENT_DATA from /topic/database -- ongoing %d",
@@ -331,6 +591,9 @@ namespace  MQTT {
             log_i("MQTT_EVENT_ERROR");
             // Handle MQTT connection problems
             cancelDBDownload();
+            cancelDBChunk();
+            cancelDBDelta();
+            cancelFlatIndexDownload();
             cancelLogUpload();
             cancelFirmwareDownload();
             resetMessageList();
@@ -0,0 +1,428 @@
+static const char *TAG = "rawdb";
+
+#include <tramela.h>
+
+#include <Arduino.h>
+
+#ifdef USE_SD
+#include "SPI.h"
+#include "SD.h"
+#else
+#include "FFat.h"
+#endif
+
+#include <sqlite3.h>
+#include <esp_partition.h>
+#include <esp_crc.h>
+#include <rawdb.h>
+
+/*
+  The Authorizer only ever reads the DB, but each page it reads goes
+  through SQLite's VFS, the ESP32 VFS and FATFS (cluster chains, sector
+  buffers and locks) before it reaches the flash. With DB_RAW_PARTITION,
+  we instead keep a copy of the DB in a raw flash partition and read it
+  with a minimal SQLite VFS: the file is mapped with esp_partition_mmap()
+  and xRead() is a memcpy() from the flash cache. The VFS reports the
+  file as immutable, so SQLite does not lock it, never looks for a
+  journal and never checks whether it changed.
+
+  The DB files on FFat/SD are still the authoritative copies: downloads,
+  patches and SQL deltas are applied to them as always (check
+  dbmanager.cpp). The partition is split in two slots, one for each of
+  the Authorizer's AuthDB objects, so when a new DB is opened it is
+  copied to the slot not in use while the old one is still answering
+  queries from the other slot. The header of a slot is written only
+  after the DB was copied and checked, so a slot is either valid or
+  ignored; if anything fails, the Authorizer opens the file instead.
+
+  Every update (even a delta of a few hundred bytes) is a new DB, so it
+  is copied to a slot; erasing the whole slot each time would mean
+  megabytes of flash erases for a small change and wear the partition.
+  The slot usually holds an older version of the same DB (the one from
+  two updates ago), though, and a delta only changes a few pages, so we
+  compare the file with the slot sector by sector and only erase and
+  rewrite the sectors that differ. Copying a DB that is already in the
+  slot (e.g. after a reboot) is skipped altogether.
+
+  Everything the VFS does not handle itself (temporary files etc.) is
+  passed on to the default VFS.
+*/
+
+static const char* slotNames[2] = { "rawdb0", "rawdb1" };
+
+static uint8_t copyBuffer[SPI_FLASH_SEC_SIZE];
+
+static inline const esp_partition_t* rawPartition() {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                    ESP_PARTITION_SUBTYPE_ANY,
+                                    RAW_DB_PARTITION);
+}
+
+static inline size_t slotSize(const esp_partition_t* partition) {
+    return partition->size / 2 / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+}
+
+static inline size_t slotOffset(const esp_partition_t* partition, int slot) {
+    return slot * slotSize(partition);
+}
+
+// Reads the header of the slot; false if the slot has no valid DB
+static bool readSlotHeader(const esp_partition_t* partition, int slot,
+                           RawDBHeader* header) {
+
+    if (esp_partition_read(partition, slotOffset(partition, slot),
+                           header, sizeof(*header)) != ESP_OK) {
+        return false;
+    }
+
+    return 0 == memcmp(header->magic, RAW_DB_MAGIC, 8)
+           and header->size > 0
+           and header->size <= slotSize(partition) - SPI_FLASH_SEC_SIZE;
+}
+
+static bool slotCRCMatches(const esp_partition_t* partition, size_t offset,
+                           size_t size, uint32_t expected) {
+
+    uint32_t crc = 0;
+    for (size_t pos = 0; pos < size; pos += sizeof(copyBuffer)) {
+        size_t len = size - pos;
+        if (len > sizeof(copyBuffer)) { len = sizeof(copyBuffer); }
+        if (esp_partition_read(partition, offset + pos,
+                               copyBuffer, len) != ESP_OK) {
+            return false;
+        }
+        crc = esp_crc32_le(crc, copyBuffer, len);
+    }
+
+    return crc == expected;
+}
+
+// Reads the next "len" bytes of the file into copyBuffer
+static bool readSector(File& file, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t n = file.read(copyBuffer + done, len - done);
+        if (n == 0) { return false; }
+        done += n;
+    }
+    return true;
+}
+
+// Compares the first "len" bytes of copyBuffer with the flash at "offset"
+static esp_err_t sectorMatches(const esp_partition_t* partition,
+                               size_t offset, size_t len, bool& same) {
+
+    uint8_t flash[256];
+    same = false;
+    for (size_t pos = 0; pos < len; pos += sizeof(flash)) {
+        size_t n = len - pos;
+        if (n > sizeof(flash)) { n = sizeof(flash); }
+        esp_err_t err = esp_partition_read(partition, offset + pos, flash, n);
+        if (err != ESP_OK) { return err; }
+        if (0 != memcmp(flash, copyBuffer + pos, n)) { return ESP_OK; }
+    }
+
+    same = true;
+    return ESP_OK;
+}
+
+bool copyToRawSlot(const char* filename, int slot) {
+    const esp_partition_t* partition = rawPartition();
+    if (partition == NULL) {
+        log_w("No raw DB partition available");
+        return false;
+    }
+
+    File file = DISK.open(filename);
+    if (not file) {
+        log_w("Cannot open %s to copy it to the raw DB partition", filename);
+        return false;
+    }
+
+    size_t size = file.size();
+    if (size == 0 or size > slotSize(partition) - SPI_FLASH_SEC_SIZE) {
+        log_w("DB does not fit in the raw DB partition (%u bytes)", size);
+        file.close();
+        return false;
+    }
+
+    uint32_t crc = 0;
+    size_t len;
+    while ((len = file.read(copyBuffer, sizeof(copyBuffer))) > 0) {
+        crc = esp_crc32_le(crc, copyBuffer, len);
+    }
+
+    RawDBHeader header;
+    if (readSlotHeader(partition, slot, &header)
+            and header.size == size and header.crc == crc) {
+
+        log_d("DB is already in raw DB slot %d", slot);
+        file.close();
+        return true;
+    }
+
+    unsigned long start = millis();
+    size_t offset = slotOffset(partition, slot);
+
+    // Erasing the header makes the slot invalid until we finish
+    esp_err_t err = esp_partition_erase_range(partition, offset,
+                                              SPI_FLASH_SEC_SIZE);
+
+    file.seek(0);
+    size_t rewritten = 0;
+    for (size_t pos = 0; err == ESP_OK and pos < size;
+                                            pos += SPI_FLASH_SEC_SIZE) {
+
+        len = size - pos;
+        if (len > SPI_FLASH_SEC_SIZE) { len = SPI_FLASH_SEC_SIZE; }
+        if (not readSector(file, len)) {
+            err = ESP_FAIL;
+            break;
+        }
+
+        size_t sector = offset + SPI_FLASH_SEC_SIZE + pos;
+        bool same;
+        err = sectorMatches(partition, sector, len, same);
+        if (err != ESP_OK or same) { continue; }
+
+        err = esp_partition_erase_range(partition, sector,
+                                        SPI_FLASH_SEC_SIZE);
+        if (err == ESP_OK) {
+            err = esp_partition_write(partition, sector, copyBuffer, len);
+        }
+        ++rewritten;
+    }
+    file.close();
+
+    if (err != ESP_OK) {
+        log_w("Error (%s) writing raw DB slot %d", esp_err_to_name(err), slot);
+        return false;
+    }
+
+    if (not slotCRCMatches(partition, offset + SPI_FLASH_SEC_SIZE,
+                           size, crc)) {
+        log_w("Raw DB slot %d does not match %s", slot, filename);
+        return false;
+    }
+
+    memcpy(header.magic, RAW_DB_MAGIC, 8);
+    header.size = size;
+    header.crc = crc;
+    err = esp_partition_write(partition, offset, &header, sizeof(header));
+    if (err != ESP_OK) {
+        log_w("Error (%s) writing raw DB slot %d header",
+              esp_err_to_name(err), slot);
+        return false;
+    }
+
+    log_i("Copied %s to raw DB slot %d (%u bytes, %u of %u sectors "
+          "rewritten) in %lu ms", filename, slot, size, rewritten,
+          (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE,
+          millis() - start);
+
+    return true;
+}
+
+// The VFS
+
+typedef struct {
+    sqlite3_file base; // must be the first member
+    const uint8_t* data;
+    sqlite3_int64 size;
+    spi_flash_mmap_handle_t mmapHandle;
+} RawFile;
+
+static sqlite3_vfs rawVFS;
+static sqlite3_vfs* defaultVFS = NULL;
+
+static int slotFromName(const char* name) {
+    if (name == NULL) { return -1; }
+    for (int slot = 0; slot < 2; ++slot) {
+        if (0 == strcmp(name, slotNames[slot])) { return slot; }
+    }
+    return -1;
+}
+
+static int rawClose(sqlite3_file* file) {
+    spi_flash_munmap(((RawFile*) file)->mmapHandle);
+    return SQLITE_OK;
+}
+
+// SQLite expects the missing part of a short read to be zeroed
+static int rawRead(sqlite3_file* file, void* buf, int amount,
+                   sqlite3_int64 offset) {
+
+    RawFile* raw = (RawFile*) file;
+    sqlite3_int64 available = offset < raw->size ? raw->size - offset : 0;
+    if (amount <= available) {
+        memcpy(buf, raw->data + offset, amount);
+        return SQLITE_OK;
+    }
+
+    memcpy(buf, raw->data + offset, available);
+    memset((uint8_t*) buf + available, 0, amount - available);
+    return SQLITE_IOERR_SHORT_READ;
+}
+
+static int rawWrite(sqlite3_file*, const void*, int, sqlite3_int64) {
+    return SQLITE_READONLY;
+}
+
+static int rawTruncate(sqlite3_file*, sqlite3_int64) {
+    return SQLITE_READONLY;
+}
+
+static int rawSync(sqlite3_file*, int) { return SQLITE_OK; }
+
+static int rawFileSize(sqlite3_file* file, sqlite3_int64* size) {
+    *size = ((RawFile*) file)->size;
+    return SQLITE_OK;
+}
+
+// Nobody writes to the slot while it is open, so there is nothing to lock
+static int rawLock(sqlite3_file*, int) { return SQLITE_OK; }
+
+static int rawCheckReservedLock(sqlite3_file*, int* reserved) {
+    *reserved = 0;
+    return SQLITE_OK;
+}
+
+static int rawFileControl(sqlite3_file*, int, void*) {
+    return SQLITE_NOTFOUND;
+}
+
+static int rawSectorSize(sqlite3_file*) { return SPI_FLASH_SEC_SIZE; }
+
+static int rawDeviceCharacteristics(sqlite3_file*) {
+    return SQLITE_IOCAP_IMMUTABLE;
+}
+
+static const sqlite3_io_methods rawIOMethods = {
+    1,
+    rawClose,
+    rawRead,
+    rawWrite,
+    rawTruncate,
+    rawSync,
+    rawFileSize,
+    rawLock,
+    rawLock, // unlock
+    rawCheckReservedLock,
+    rawFileControl,
+    rawSectorSize,
+    rawDeviceCharacteristics
+};
+
+static int rawOpen(sqlite3_vfs*, const char* name, sqlite3_file* file,
+                   int flags, int* outFlags) {
+
+    int slot = slotFromName(name);
+    if (slot < 0) {
+        return defaultVFS->xOpen(defaultVFS, name, file, flags, outFlags);
+    }
+
+    file->pMethods = NULL; // so SQLite does not call rawClose() on errors
+    if (not (flags & SQLITE_OPEN_MAIN_DB) or (flags & SQLITE_OPEN_READWRITE)) {
+        return SQLITE_CANTOPEN;
+    }
+
+    const esp_partition_t* partition = rawPartition();
+    RawDBHeader header;
+    if (partition == NULL or not readSlotHeader(partition, slot, &header)) {
+        log_w("No valid DB in raw DB slot %d", slot);
+        return SQLITE_CANTOPEN;
+    }
+
+    RawFile* raw = (RawFile*) file;
+    const void* mapped;
+    esp_err_t err = esp_partition_mmap(partition,
+                            slotOffset(partition, slot) + SPI_FLASH_SEC_SIZE,
+                            header.size, SPI_FLASH_MMAP_DATA,
+                            &mapped, &raw->mmapHandle);
+
+    if (err != ESP_OK) {
+        log_w("Error (%s) mapping raw DB slot %d", esp_err_to_name(err), slot);
+        return SQLITE_CANTOPEN;
+    }
+
+    raw->data = (const uint8_t*) mapped;
+    raw->size = header.size;
+    file->pMethods = &rawIOMethods;
+    if (outFlags != NULL) { *outFlags = SQLITE_OPEN_READONLY; }
+    return SQLITE_OK;
+}
+
+static int rawDelete(sqlite3_vfs*, const char* name, int syncDir) {
+    if (slotFromName(name) >= 0) { return SQLITE_IOERR_DELETE; }
+    return defaultVFS->xDelete(defaultVFS, name, syncDir);
+}
+
+static int rawAccess(sqlite3_vfs*, const char* name, int flags, int* result) {
+    return defaultVFS->xAccess(defaultVFS, name, flags, result);
+}
+
+static int rawFullPathname(sqlite3_vfs*, const char* name, int size,
+                           char* out) {
+
+    if (slotFromName(name) >= 0) {
+        snprintf(out, size, "%s", name);
+        return SQLITE_OK;
+    }
+    return defaultVFS->xFullPathname(defaultVFS, name, size, out);
+}
+
+static int rawRandomness(sqlite3_vfs*, int size, char* out) {
+    return defaultVFS->xRandomness(defaultVFS, size, out);
+}
+
+static int rawSleep(sqlite3_vfs*, int microseconds) {
+    return defaultVFS->xSleep(defaultVFS, microseconds);
+}
+
+static int rawCurrentTime(sqlite3_vfs*, double* now) {
+    return defaultVFS->xCurrentTime(defaultVFS, now);
+}
+
+static int rawGetLastError(sqlite3_vfs*, int size, char* out) {
+    return defaultVFS->xGetLastError(defaultVFS, size, out);
+}
+
+static int registerRawVFS() {
+    if (defaultVFS != NULL) { return SQLITE_OK; }
+
+    sqlite3_vfs* vfs = sqlite3_vfs_find(NULL);
+    if (vfs == NULL) { return SQLITE_ERROR; }
+
+    memset(&rawVFS, 0, sizeof(rawVFS));
+    rawVFS.iVersion = 1;
+    rawVFS.szOsFile = vfs->szOsFile > (int) sizeof(RawFile) ? vfs->szOsFile
+                                                       : sizeof(RawFile);
+    rawVFS.mxPathname = vfs->mxPathname;
+    rawVFS.zName = RAW_DB_VFS;
+    rawVFS.xOpen = rawOpen;
+    rawVFS.xDelete = rawDelete;
+    rawVFS.xAccess = rawAccess;
+    rawVFS.xFullPathname = rawFullPathname;
+    // xDlOpen etc. are only used by sqlite3_load_extension()
+    rawVFS.xRandomness = rawRandomness;
+    rawVFS.xSleep = rawSleep;
+    rawVFS.xCurrentTime = rawCurrentTime;
+    rawVFS.xGetLastError = rawGetLastError;
+
+    defaultVFS = vfs;
+    int rc = sqlite3_vfs_register(&rawVFS, 0);
+    if (rc != SQLITE_OK) { defaultVFS = NULL; }
+    return rc;
+}
+
+int openRawSlot(int slot, sqlite3** db) {
+    *db = NULL;
+    int rc = registerRawVFS();
+    if (rc != SQLITE_OK) {
+        log_e("Cannot register the raw DB VFS: %s", sqlite3_errstr(rc));
+        return rc;
+    }
+
+    return sqlite3_open_v2(slotNames[slot], db, SQLITE_OPEN_READONLY,
+                           RAW_DB_VFS);
+}
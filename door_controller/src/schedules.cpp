@@ -0,0 +1,157 @@
+static const char *TAG = "sched";
+
+#include <tramela.h>
+#include <Arduino.h>
+#include <sqlite3.h>
+#include <schedules.h>
+#include <time.h>
+
+/*
+  Some users may only be allowed to enter at certain times (weekdays or
+  daytime only, for example). Doing this in SQL would mean more joins
+  and time arithmetic on every query, so instead each row of the "auth"
+  table may carry a schedule ID ("auth.schedule"; NULL or 0 means no
+  restrictions) and the "schedules" table defines the allowed windows:
+
+      create table schedules (ID integer not null, weekday integer not null,
+                              start integer not null, end integer not null);
+
+  Each row allows access on "weekday" (0 = Sunday, as in "struct tm" and
+  strftime('%w')) from minute "start" to minute "end" (local time, with
+  0 <= start < end <= 1440). A schedule may have any number of rows; a
+  window that crosses midnight needs two rows. When the DB is opened, we
+  compile all of this into one 7x96 bitmask per schedule (one bit per
+  quarter hour), rounding each window inwards to whole quarter hours, so
+  we never allow access outside of the configured times.
+
+  If we do not know the current time, restricted users are denied. So
+  are users whose "auth.schedule" is not a valid ID: truncating it to 16
+  bits could turn it into NO_SCHEDULE (65536) or MIXED_SCHEDULES.
+*/
+
+bool scheduleFromColumn(sqlite3_stmt* query, int col, uint16_t& scheduleID) {
+    scheduleID = NO_SCHEDULE;
+
+    int type = sqlite3_column_type(query, col);
+    if (type == SQLITE_NULL) { return true; }
+    if (type != SQLITE_INTEGER) { return false; }
+
+    sqlite3_int64 ID = sqlite3_column_int64(query, col);
+    if (ID < NO_SCHEDULE or ID >= MIXED_SCHEDULES) { return false; }
+
+    scheduleID = ID;
+    return true;
+}
+
+bool ScheduleTable::build(sqlite3* db) {
+    clear();
+
+    sqlite3_stmt* query;
+    int rc = sqlite3_prepare_v2(db, "SELECT ID, weekday, start, end "
+                                    "FROM schedules ORDER BY ID",
+                                -1, &query, NULL);
+    if (rc != SQLITE_OK) {
+        log_w("Cannot read schedules: %s", sqlite3_errmsg(db));
+        return false;
+    }
+
+    schedules = (Schedule*) calloc(MAX_SCHEDULES, sizeof(Schedule));
+    if (schedules == NULL) {
+        log_w("Could not allocate memory for the schedules");
+        sqlite3_finalize(query);
+        return false;
+    }
+
+    rc = sqlite3_step(query);
+    while (rc == SQLITE_ROW) {
+        int ID = sqlite3_column_int(query, 0);
+        int weekday = sqlite3_column_int(query, 1);
+        int start = sqlite3_column_int(query, 2);
+        int end = sqlite3_column_int(query, 3);
+
+        if (ID <= NO_SCHEDULE or ID >= MIXED_SCHEDULES or weekday < 0
+                or weekday > 6 or start < 0 or end > 24 * 60) {
+
+            log_w("Ignoring invalid schedule entry (%d, %d, %d, %d)",
+                  ID, weekday, start, end);
+            rc = sqlite3_step(query);
+            continue;
+        }
+
+        // Rows are sorted by ID, so a new ID always goes at the end
+        if (count == 0 or schedules[count -1].ID != ID) {
+            if (count == MAX_SCHEDULES) {
+                log_e("Too many schedules, ignoring schedule %d", ID);
+                rc = sqlite3_step(query);
+                continue;
+            }
+            schedules[count++].ID = ID;
+        }
+
+        uint8_t* mask = schedules[count -1].mask;
+        int first = (start + SCHEDULE_SLOT_MINUTES -1) / SCHEDULE_SLOT_MINUTES;
+        int last = end / SCHEDULE_SLOT_MINUTES; // exclusive
+        for (int slot = first; slot < last; ++slot) {
+            int bit = weekday * SCHEDULE_SLOTS_PER_DAY + slot;
+            mask[bit / 8] |= 1 << (bit % 8);
+        }
+
+        rc = sqlite3_step(query);
+    }
+    sqlite3_finalize(query);
+
+    // Missing windows would deny access to valid users
+    if (rc != SQLITE_DONE) {
+        log_w("Error reading schedules: %s", sqlite3_errmsg(db));
+        clear();
+        return false;
+    }
+
+    log_i("Compiled %u schedules", count);
+    return true;
+}
+
+void ScheduleTable::clear() {
+    free(schedules);
+    schedules = NULL;
+    count = 0;
+}
+
+ScheduleTable::Schedule* ScheduleTable::find(uint16_t scheduleID) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (schedules[mid].ID == scheduleID) { return schedules + mid; }
+        if (schedules[mid].ID < scheduleID) {
+            low = mid +1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return NULL;
+}
+
+bool ScheduleTable::allows(uint16_t scheduleID, unsigned long now) {
+    if (scheduleID == NO_SCHEDULE) { return true; }
+
+    Schedule* schedule = find(scheduleID);
+    if (schedule == NULL) {
+        log_w("Unknown schedule %u, denying access", scheduleID);
+        return false;
+    }
+
+    if (now == 0) {
+        log_w("Current time unknown, denying access to restricted user");
+        return false;
+    }
+
+    time_t t = now;
+    struct tm local;
+    localtime_r(&t, &local);
+    int bit = local.tm_wday * SCHEDULE_SLOTS_PER_DAY
+              + (local.tm_hour * 60 + local.tm_min) / SCHEDULE_SLOT_MINUTES;
+
+    return schedule->mask[bit / 8] & (1 << (bit % 8));
+}
@@ -0,0 +1,118 @@
+static const char* TAG = "sqlmem";
+
+#include <tramela.h>
+
+#include <Arduino.h>
+#include <sqlite3.h>
+#include <sqlitemem.h>
+
+/*
+  By default, SQLite uses malloc(), so its allocations (the connections,
+  the prepared statements and, mostly, the page cache) are interleaved
+  with those of mbedTLS, the MQTT buffers etc. After a few days of
+  opening and closing DBs, the heap may be so fragmented that one of
+  them fails even if there is enough free memory overall.
+
+  Instead, we give SQLite a memory region of its own: an arena of
+  SQLITE_ARENA_SIZE bytes, managed by SQLite with its buddy allocator
+  (memsys5, SQLITE_CONFIG_HEAP), and a pool of SQLITE_PAGECACHE_PAGES
+  page cache slots (SQLITE_CONFIG_PAGECACHE). When the pool is full,
+  SQLite reuses the least recently used pages instead of allocating
+  more; we also set a soft heap limit below the size of the arena, so
+  it does the same for pages that did not fit in the pool before
+  failing with SQLITE_NOMEM. Memory use is then fixed at build time and
+  each deployment may tune it with the defines in sqlitemem.h. We
+  allocate both regions as soon as the disk is up, before WiFi, TLS and
+  MQTT start using the heap, so they are contiguous; a static array of
+  this size might not fit in the DRAM segment the linker uses for .bss.
+
+  This requires SQLite to be compiled with SQLITE_ENABLE_MEMSYS5; if it
+  is not, sqlite3_config() fails and we release the memory and let
+  SQLite use the general heap, as before.
+
+  Remember that, while a new DB is being opened, the Authorizer has two
+  DBs open (check authorizer.cpp), so the arena must be large enough
+  for both; openDB() logs how much of it has been used (the high-water
+  mark), which is what to look at when tuning these values.
+*/
+
+static void* arena = NULL;
+static void* pageCache = NULL;
+static int pageSlotSize = 0;
+
+static bool configureMemory() {
+    int headerSize = 0;
+    if (sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &headerSize) != SQLITE_OK) {
+        return false;
+    }
+    pageSlotSize = (SQLITE_PAGE_SIZE + headerSize + 7) & ~7;
+
+    arena = heap_caps_malloc(SQLITE_ARENA_SIZE, MALLOC_CAP_8BIT);
+    pageCache = heap_caps_malloc(pageSlotSize * SQLITE_PAGECACHE_PAGES,
+                                 MALLOC_CAP_8BIT);
+
+    if (arena == NULL or pageCache == NULL) {
+        log_w("Not enough memory for the SQLite arena");
+        return false;
+    }
+
+    if (sqlite3_config(SQLITE_CONFIG_HEAP, arena, SQLITE_ARENA_SIZE,
+                       SQLITE_ARENA_MIN_ALLOC) != SQLITE_OK) {
+        log_w("SQLite was compiled without memsys5, using the heap");
+        return false;
+    }
+
+    if (sqlite3_config(SQLITE_CONFIG_PAGECACHE, pageCache, pageSlotSize,
+                       SQLITE_PAGECACHE_PAGES) != SQLITE_OK) {
+        log_w("Could not configure the SQLite page cache pool");
+        return false;
+    }
+
+    // Also needed so we can report the high-water mark
+    sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 1);
+    return true;
+}
+
+void initSQLite() {
+    if (SQLITE_ARENA_SIZE > 0 and not configureMemory()) {
+        // Back to the defaults; a NULL arena restores the default allocator
+        sqlite3_config(SQLITE_CONFIG_HEAP, NULL, 0, 0);
+        sqlite3_config(SQLITE_CONFIG_PAGECACHE, NULL, 0, 0);
+        free(arena);
+        free(pageCache);
+        arena = NULL;
+        pageCache = NULL;
+    }
+
+    int rc = sqlite3_initialize();
+    if (rc != SQLITE_OK) {
+        log_e("Cannot initialize SQLite: %s", sqlite3_errstr(rc));
+        return;
+    }
+
+    if (arena != NULL) {
+        sqlite3_soft_heap_limit64(SQLITE_ARENA_SIZE * 3 / 4);
+        log_i("SQLite uses a %d KB arena and %d page cache slots of %d "
+              "bytes", SQLITE_ARENA_SIZE / 1024, SQLITE_PAGECACHE_PAGES,
+              pageSlotSize);
+    }
+}
+
+void logSQLiteMemory() {
+    sqlite3_int64 used = sqlite3_memory_used();
+    sqlite3_int64 highwater = sqlite3_memory_highwater(0);
+    int pages, pagesHighwater;
+    sqlite3_status(SQLITE_STATUS_PAGECACHE_USED, &pages, &pagesHighwater, 0);
+
+    if (arena == NULL) {
+        log_i("SQLite memory: %lld KB in use, at most %lld KB so far "
+              "(general heap)", used / 1024, highwater / 1024);
+        return;
+    }
+
+    log_i("SQLite memory: %lld KB in use, at most %lld KB so far, of a "
+          "%d KB arena; page cache pool: %d of %d slots in use, at most "
+          "%d so far", used / 1024, highwater / 1024,
+          SQLITE_ARENA_SIZE / 1024, pages, SQLITE_PAGECACHE_PAGES,
+          pagesHighwater);
+}
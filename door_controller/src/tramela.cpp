@@ -4,7 +4,7 @@ static const char* TAG = "main";
 
 #include <Arduino.h>
 
-#include <sqlite3.h> // sqlite3_initialize()
+#include <sqlitemem.h> // initSQLite()
 
 #include <networkmanager.h>
 #include <timemanager.h>
@@ -14,6 +14,7 @@ static const char* TAG = "main";
 #include <mqttmanager.h>
 #include <diskmanager.h>
 #include <firmwareOTA.h> // firmwareOKWatchdog()
+#include <authorizer.h> // openFlatIndex(), loadAuthSnapshot()
 
 int doorID = 1;
 
@@ -41,11 +42,16 @@ void setup() {
 
     if (diskOK) { initDiskLog(); }
 
+    // Before WiFi, TLS etc. start using the heap (check sqlitemem.cpp)
+    if (diskOK) { initSQLite(); }
+
     initWiFi(); // The sooner the better :), but after disk logging is up
 
     // So we can check for the master key during time initialization
     initDoor();
     initCardReaders();
+    openFlatIndex(); // This does not depend on the disk
+    loadAuthSnapshot(); // Neither does this (it is in NVS)
 
     // Make sure we have the correct time before continuing. If we already
     // got the time from the HW clock above, great; if not, wait for NTP.
@@ -53,7 +59,7 @@ void setup() {
     while(!initTime()) { // Timeouts after 2s
         firmwareOKWatchdog();
 
-        checkDoor(); // No DB yet, so this only works for the master key
+        checkDoor(); // No DB yet: master key, flat index or snapshot only
 
         ++attempts;
 
@@ -70,7 +76,6 @@ void setup() {
         }
     }
 
-    if (diskOK) { sqlite3_initialize(); }
     initMqtt(diskOK); // mqtt can partially work even without the disk
     if (diskOK) { initDBMan(); }
     firmwareOKWatchdog();
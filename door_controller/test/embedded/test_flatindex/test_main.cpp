@@ -0,0 +1,91 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <esp_partition.h>
+#include <esp_crc.h>
+#include <tramela.h>
+#include <flatindex.h>
+#include <dbmanager.h> // writeToFlatIndex(), finishFlatIndexDownload()
+#include <authindex.h> // HASH_SIZE
+
+// These are defined in tramela.cpp, which is not built with the tests
+int doorID = 1;
+unsigned long currentMillis;
+
+// Two sorted hashes
+static uint8_t hashes[2 * HASH_SIZE];
+
+// Sends a sorted flat index like mqttmanager.cpp does, with the header
+// split in two messages, and returns its header
+static FlatIndexHeader sendIndex(uint32_t count, uint32_t version) {
+    FlatIndexHeader header;
+    memcpy(header.magic, FLAT_INDEX_MAGIC, sizeof(header.magic));
+    header.doorID = doorID;
+    header.count = count;
+    header.recordSize = HASH_SIZE;
+    header.dbVersion = version;
+    header.bodySize = count * HASH_SIZE;
+    header.crc = esp_crc32_le(0, hashes, header.bodySize);
+
+    const char* data = (const char*) &header;
+    writeToFlatIndex(data, 8);
+    writeToFlatIndex(data + 8, sizeof(header) - 8);
+    if (count > 0) {
+        writeToFlatIndex((const char*) hashes, header.bodySize);
+    }
+    finishFlatIndexDownload();
+
+    return header;
+}
+
+static void checkPartitionHeader(const FlatIndexHeader& expected) {
+    const esp_partition_t* partition = esp_partition_find_first(
+                                            ESP_PARTITION_TYPE_DATA,
+                                            ESP_PARTITION_SUBTYPE_ANY,
+                                            FLAT_INDEX_PARTITION);
+    TEST_ASSERT_NOT_NULL(partition);
+
+    FlatIndexHeader header;
+    esp_partition_read(partition, 0, &header, sizeof(header));
+    TEST_ASSERT_EQUAL_MEMORY(&expected, &header, sizeof(header));
+    TEST_ASSERT_TRUE(flatIndexHeaderIsValid(&header, partition->size));
+}
+
+void test_index_with_records() {
+    checkPartitionHeader(sendIndex(2, 1));
+
+    FlatIndex index;
+    bool found = false;
+    TEST_ASSERT_TRUE(index.open());
+    TEST_ASSERT_TRUE(index.lookup(hashes + HASH_SIZE, found));
+    TEST_ASSERT_TRUE(found);
+    index.close();
+}
+
+// A door with no authorized users: the header must replace the previous
+// one even though there are no records to write
+void test_empty_index_replaces_previous() {
+    sendIndex(2, 1);
+    checkPartitionHeader(sendIndex(0, 2));
+
+    FlatIndex index;
+    bool found = true;
+    TEST_ASSERT_TRUE(index.open());
+    TEST_ASSERT_TRUE(index.lookup(hashes, found));
+    TEST_ASSERT_FALSE(found);
+    index.close();
+}
+
+void setup() {
+    delay(2000); // wait for the serial monitor
+
+    for (int i = 0; i < (int) sizeof(hashes); ++i) {
+        hashes[i] = i < HASH_SIZE ? 0x10 + i : 0x80 + i;
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_index_with_records);
+    RUN_TEST(test_empty_index_replaces_previous);
+    UNITY_END();
+}
+
+void loop() {}
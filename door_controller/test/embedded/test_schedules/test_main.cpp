@@ -0,0 +1,103 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <sqlite3.h>
+#include <tramela.h>
+#include <schedules.h>
+#include <authindex.h>
+
+// These are defined in tramela.cpp, which is not built with the tests
+int doorID = 1;
+unsigned long currentMillis;
+
+// One user per value of "auth.schedule"; the first byte of each hash
+// is its position here
+static const char* values[] = {
+    "NULL", "0", "7", "65534", "65535", "65536", "4294967296", "-1",
+    "'abc'", "7.5"
+};
+static const bool valid[] = {
+    true, true, true, true, false, false, false, false, false, false
+};
+static const uint16_t expected[] = { NO_SCHEDULE, NO_SCHEDULE, 7, 65534 };
+
+#define USERS (sizeof(values) / sizeof(values[0]))
+
+static sqlite3* db;
+
+static void userHash(int user, uint8_t* binHash) {
+    memset(binHash, 0x55, HASH_SIZE);
+    binHash[0] = user;
+}
+
+static void createDB() {
+    TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_open(":memory:", &db));
+    sqlite3_exec(db, "CREATE TABLE auth (userID BLOB, doorID INTEGER, "
+                     "schedule INTEGER)", NULL, NULL, NULL);
+
+    for (int i = 0; i < (int) USERS; ++i) {
+        uint8_t binHash[HASH_SIZE];
+        userHash(i, binHash);
+        char sql[200];
+        int n = snprintf(sql, sizeof(sql), "INSERT INTO auth VALUES (x'");
+        for (int j = 0; j < HASH_SIZE; ++j) {
+            n += snprintf(sql + n, sizeof(sql) - n, "%02x", binHash[j]);
+        }
+        snprintf(sql + n, sizeof(sql) - n, "', 1, %s)", values[i]);
+        TEST_ASSERT_EQUAL(SQLITE_OK,
+                          sqlite3_exec(db, sql, NULL, NULL, NULL));
+    }
+}
+
+void test_schedule_from_column() {
+    sqlite3_stmt* query;
+    TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_prepare_v2(db,
+                        "SELECT schedule FROM auth ORDER BY userID",
+                        -1, &query, NULL));
+
+    for (int i = 0; i < (int) USERS; ++i) {
+        TEST_ASSERT_EQUAL(SQLITE_ROW, sqlite3_step(query));
+        uint16_t scheduleID;
+        TEST_ASSERT_EQUAL_MESSAGE(valid[i],
+                                  scheduleFromColumn(query, 0, scheduleID),
+                                  values[i]);
+        if (valid[i]) {
+            TEST_ASSERT_EQUAL_UINT16(expected[i], scheduleID);
+        }
+    }
+    sqlite3_finalize(query);
+}
+
+// Out-of-range schedules must not become NO_SCHEDULE (or anything else)
+void test_index_skips_invalid_schedules() {
+    AuthIndex index;
+    TEST_ASSERT_TRUE(index.build(db, "SELECT userID, schedule FROM auth "
+                                     "WHERE doorID=1", true));
+
+    for (int i = 0; i < (int) USERS; ++i) {
+        uint8_t binHash[HASH_SIZE];
+        userHash(i, binHash);
+        uint16_t scheduleID;
+        TEST_ASSERT_EQUAL_MESSAGE(valid[i],
+                                  index.contains(binHash, scheduleID),
+                                  values[i]);
+        if (valid[i]) {
+            TEST_ASSERT_EQUAL_UINT16(expected[i], scheduleID);
+        }
+    }
+    index.clear();
+}
+
+void setup() {
+    delay(2000); // wait for the serial monitor
+
+    createDB();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_schedule_from_column);
+    RUN_TEST(test_index_skips_invalid_schedules);
+    UNITY_END();
+
+    sqlite3_close(db);
+}
+
+void loop() {}
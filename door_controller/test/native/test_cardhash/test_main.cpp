@@ -0,0 +1,69 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <mbedtls/md.h>
+#include <cardhash.h>
+
+// How card IDs were hashed before cardhash.cpp: sprintf() and mbedtls_md,
+// then sprintf() again for the hexadecimal string. The hashes in the DBs
+// were generated like this, so the new code must match it exactly.
+static void oldHash(unsigned long cardID, uint8_t* binHash, char* hashBuf) {
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init(&ctx);
+    mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&ctx);
+
+    char buf[11]; // 10 digits + '\0'
+    sprintf(buf, "%10lu", cardID);
+    mbedtls_md_update(&ctx, (const unsigned char *) buf, 10);
+    mbedtls_md_finish(&ctx, binHash);
+    mbedtls_md_free(&ctx);
+
+    for (int i = 0; i < 32; ++i) {
+        sprintf(hashBuf + 2 * i, "%02x", binHash[i]);
+    }
+}
+
+static void checkCard(unsigned long cardID) {
+    uint8_t expectedBin[32];
+    char expectedHex[65];
+    oldHash(cardID, expectedBin, expectedHex);
+
+    uint8_t binHash[32];
+    char hashBuf[65];
+    memset(hashBuf, 'x', sizeof(hashBuf));
+    cardHash(cardID, binHash);
+    cardHashToHex(binHash, hashBuf);
+
+    char message[40];
+    snprintf(message, sizeof(message), "card ID %lu", cardID);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expectedBin, binHash, 32, message);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(expectedHex, hashBuf, message);
+}
+
+// Every number of digits, with and without padding
+void test_digit_boundaries() {
+    unsigned long power = 1;
+    for (int digits = 1; digits <= 10; ++digits) {
+        checkCard(power - 1);
+        checkCard(power);
+        checkCard(power + 1);
+        power *= 10;
+    }
+    checkCard(4294967295UL); // the largest 32-bit card ID
+}
+
+void test_many_card_ids() {
+    uint32_t cardID = 12345;
+    for (int i = 0; i < 10000; ++i) {
+        checkCard(cardID);
+        cardID = cardID * 1664525 + 1013904223; // any LCG will do
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_digit_boundaries);
+    RUN_TEST(test_many_card_ids);
+    return UNITY_END();
+}
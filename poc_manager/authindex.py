@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Generate the "flat index" for a door from the door controller DB.
+
+   The flat index is an alternative to the SQLite DB for sites with many
+   users: a 32-byte header followed by either the sorted binary hashes of
+   the users authorized to open the door or a perfect hash table with
+   64-bit fingerprints of these hashes. The door controller writes it to
+   a dedicated flash partition and searches it in place (check
+   door_controller/src/flatindex.cpp for the details of both formats).
+
+   Usage: authindex.py [--mph] file.db doorID output.idx"""
+
+import math, sqlite3, struct, sys, zlib
+
+FLAT_INDEX_MAGIC = b"TRAMIDX1"
+MPH_INDEX_MAGIC = b"TRAMMPH1"
+HASH_SIZE = 32
+FINGERPRINT_SIZE = 8
+
+# Average number of keys per bucket and fraction of occupied slots
+# for the perfect hash table
+MPH_BUCKET_SIZE = 5
+MPH_LOAD_FACTOR = 0.99
+MPH_PILOT_MULTIPLIER = 0x9E3779B97F4A7C15
+
+# Below this, the sorted format is small enough and faster to build
+MPH_MIN_USERS = 1000
+
+
+def key_to_bytes(key):
+    """Schema v1 stores the hashes as hexadecimal TEXT, v2 as BLOBs"""
+    if isinstance(key, bytes):
+        return key if len(key) == HASH_SIZE else None
+    try:
+        # The controller only matches lowercase hashes in v1 DBs
+        if key != key.lower():
+            return None
+        binary = bytes.fromhex(key)
+    except (ValueError, AttributeError):
+        return None
+    return binary if len(binary) == HASH_SIZE else None
+
+
+def columns(conn, table):
+    return [row[1] for row in conn.execute(f"pragma table_info({table})")]
+
+
+def users_query(conn, door):
+    """Same as Authorizer::buildQueries() in the door controller: the
+       door may be open to anybody and "auth" may refer to door groups"""
+    if "anybody" in columns(conn, "doors"):
+        row = conn.execute("select anybody from doors where ID=?",
+                           (door,)).fetchone()
+        if row and row[0]:
+            return "select ID from users", ()
+
+    if "groupID" in columns(conn, "auth"):
+        return ("select userID from auth where groupID in "
+                "(select ID from groups where doorID=?)", (door,))
+
+    return "select userID from auth where doorID=?", (door,)
+
+
+def authorized_hashes(dbfile, door):
+    """The sorted, deduplicated binary hashes authorized for this door"""
+    conn = sqlite3.connect(dbfile)
+    rows = conn.execute(*users_query(conn, door))
+    hashes = {key_to_bytes(row[0]) for row in rows}
+    hashes.discard(None)
+    conn.close()
+    return sorted(hashes)
+
+
+def db_version(dbfile):
+    conn = sqlite3.connect(dbfile)
+    version = conn.execute("pragma user_version").fetchone()[0]
+    conn.close()
+    return version
+
+
+def doors(dbfile):
+    conn = sqlite3.connect(dbfile)
+    result = [row[0] for row in conn.execute("select ID from doors")]
+    conn.close()
+    return result
+
+
+def header(magic, door, count, record_size, version, body):
+    return struct.pack("<8sIIIIII", magic, door, count, record_size,
+                       version, zlib.crc32(body), len(body))
+
+
+def build_flat_index(dbfile, door):
+    records = b"".join(authorized_hashes(dbfile, door))
+    return header(FLAT_INDEX_MAGIC, door, len(records) // HASH_SIZE,
+                  HASH_SIZE, db_version(dbfile), records) + records
+
+
+def mph_split(key):
+    """bucket selector, slot key and fingerprint, straight from the digest"""
+    b, k = struct.unpack_from("<IQ", key)
+    return b, k, key[12:12 + FINGERPRINT_SIZE]
+
+
+def mph_slot(k, pilot, num_slots):
+    mix = (pilot * MPH_PILOT_MULTIPLIER) & 0xFFFFFFFFFFFFFFFF
+    return (k ^ mix) % num_slots
+
+
+def build_mph_table(hashes):
+    """Returns (num_slots, num_buckets, pilots, fingerprints) for the
+       "hash and displace" table described in flatindex.cpp"""
+    num_slots = max(1, math.ceil(len(hashes) / MPH_LOAD_FACTOR))
+    num_buckets = max(1, math.ceil(len(hashes) / MPH_BUCKET_SIZE))
+
+    buckets = [[] for _ in range(num_buckets)]
+    for key in hashes:
+        b, k, fingerprint = mph_split(key)
+        buckets[b % num_buckets].append((k, fingerprint))
+
+    pilots = [0] * num_buckets
+    fingerprints = [bytes(FINGERPRINT_SIZE)] * num_slots
+    taken = bytearray(num_slots)
+
+    # Largest buckets first, while it is still easy to find free slots
+    order = sorted(range(num_buckets), key=lambda b: -len(buckets[b]))
+    for b in order:
+        keys = buckets[b]
+        if not keys:
+            continue
+        for pilot in range(1 << 16):
+            slots = [mph_slot(k, pilot, num_slots) for (k, _) in keys]
+            if (len(set(slots)) == len(slots)
+                    and not any(taken[s] for s in slots)):
+                break
+        else:
+            raise ValueError(f"cannot find a pilot for bucket {b}")
+
+        pilots[b] = pilot
+        for s, (_, fingerprint) in zip(slots, keys):
+            taken[s] = 1
+            fingerprints[s] = fingerprint
+
+    return num_slots, num_buckets, pilots, fingerprints
+
+
+def build_mph_index(dbfile, door):
+    hashes = authorized_hashes(dbfile, door)
+    num_slots, num_buckets, pilots, fingerprints = build_mph_table(hashes)
+
+    pilots = struct.pack(f"<{num_buckets}H", *pilots)
+    pilots += bytes(-len(pilots) % 4) # padding
+    body = (struct.pack("<II", num_slots, num_buckets) + pilots
+            + b"".join(fingerprints))
+
+    return header(MPH_INDEX_MAGIC, door, len(hashes), FINGERPRINT_SIZE,
+                  db_version(dbfile), body) + body
+
+
+def build_index(dbfile, door):
+    """The perfect hash table for large doors, the sorted format otherwise"""
+    if len(authorized_hashes(dbfile, door)) >= MPH_MIN_USERS:
+        return build_mph_index(dbfile, door)
+    return build_flat_index(dbfile, door)
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    mph = "--mph" in args
+    if mph:
+        args.remove("--mph")
+    if len(args) != 3:
+        print(__doc__)
+        sys.exit(1)
+
+    build = build_mph_index if mph else build_flat_index
+    with open(args[2], "wb") as f:
+        f.write(build(args[0], int(args[1])))
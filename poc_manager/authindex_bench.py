@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Compare the lookup formats available to the door controller: the
+   SQLite DB (schemas v1 and v2), the sorted flat index and the perfect
+   hash flat index. For each number of users, we generate a synthetic
+   DB and report, for each format, the number of flash reads (pages for
+   SQLite, records for the flat indexes) per lookup and the number of
+   bytes per authorized user.
+
+   Usage: authindex_bench.py [numusers ...]"""
+
+import hashlib, os, random, sqlite3, struct, sys, tempfile, time
+
+import authindex
+
+DOOR = 1
+LOOKUPS = 2000
+
+
+def create_db(filename, numusers, binary, page_size=None):
+    if os.path.exists(filename):
+        os.remove(filename)
+    conn = sqlite3.connect(filename)
+    if binary:
+        conn.execute("create table users (ID blob primary key, name text) "
+                     "without rowid")
+        conn.execute("create table doors (ID integer primary key, "
+                     "location text)")
+        conn.execute("create table auth (userID blob not null, "
+                     "doorID integer not null, primary key (userID, doorID)) "
+                     "without rowid")
+    else:
+        conn.execute("create table users (ID text primary key, name text)")
+        conn.execute("create table doors (ID integer primary key, "
+                     "location text)")
+        conn.execute("create table auth (userID text not null, "
+                     "doorID integer not null)")
+        conn.execute("create index useridx on auth(userID, doorID)")
+
+    conn.execute("insert into doors values (?, 'benchmark')", (DOOR,))
+    for i in range(numusers):
+        digest = hashlib.sha256(b"%10d" % i).digest()
+        key = digest if binary else digest.hex()
+        conn.execute("insert into users values (?, ?)", (key, f"user {i}"))
+        conn.execute("insert into auth values (?, ?)", (key, DOOR))
+    conn.commit()
+    if page_size:
+        conn.execute(f"pragma page_size={page_size}")
+    conn.execute("vacuum")
+    conn.close()
+
+
+def sqlite_stats(filename, btree, numusers):
+    """(pages per lookup, bytes per user) for the B-tree used by queries"""
+    conn = sqlite3.connect(filename)
+    page_size = conn.execute("pragma page_size").fetchone()[0]
+    rows = conn.execute("select path from dbstat where name=?",
+                        (btree,)).fetchall()
+    conn.close()
+    depth = max(path.count("/") for (path,) in rows)
+    return depth, len(rows) * page_size / numusers
+
+
+def sorted_probes(hashes, keys):
+    """Average number of records read by a binary search"""
+    total = 0
+    for key in keys:
+        low, high = 0, len(hashes)
+        while low < high:
+            mid = (low + high) // 2
+            total += 1
+            if hashes[mid] == key:
+                break
+            if hashes[mid] < key:
+                low = mid + 1
+            else:
+                high = mid
+    return total / len(keys)
+
+
+def mph_check(index, hashes, keys):
+    """Make sure the perfect hash table finds every authorized user"""
+    body = index[32:]
+    num_slots, num_buckets = struct.unpack_from("<II", body)
+    pilots = struct.unpack_from(f"<{num_buckets}H", body, 8)
+    fingerprints = body[8 + (num_buckets * 2 + 3) // 4 * 4:]
+    authorized = set(hashes)
+    for key in keys:
+        b, k, fingerprint = authindex.mph_split(key)
+        slot = authindex.mph_slot(k, pilots[b % num_buckets], num_slots)
+        stored = fingerprints[slot * 8:slot * 8 + 8]
+        if (stored == fingerprint) != (key in authorized):
+            raise AssertionError("perfect hash table lookup failed")
+
+
+def bench(numusers, tmpdir):
+    v1 = os.path.join(tmpdir, "v1.db")
+    v2 = os.path.join(tmpdir, "v2.db")
+    create_db(v1, numusers, False)
+    create_db(v2, numusers, True)
+
+    hashes = authindex.authorized_hashes(v2, DOOR)
+    hits = random.sample(hashes, min(LOOKUPS // 2, len(hashes)))
+    misses = [os.urandom(32) for _ in range(LOOKUPS // 2)]
+    keys = hits + misses
+
+    results = []
+    pages, size = sqlite_stats(v1, "useridx", numusers)
+    results.append(("SQLite v1", pages, size, os.path.getsize(v1)))
+    pages, size = sqlite_stats(v2, "auth", numusers)
+    results.append(("SQLite v2", pages, size, os.path.getsize(v2)))
+
+    index = authindex.build_flat_index(v2, DOOR)
+    results.append(("sorted flat index", sorted_probes(hashes, keys),
+                    (len(index) - 32) / numusers, len(index)))
+
+    start = time.time()
+    index = authindex.build_mph_index(v2, DOOR)
+    elapsed = time.time() - start
+    mph_check(index, hashes, keys)
+    results.append(("perfect hash index", 2, (len(index) - 32) / numusers,
+                    len(index)))
+
+    print(f"\n{numusers} users (perfect hash table built in {elapsed:.1f}s)")
+    print(f"{'format':<20} {'reads/lookup':>12} {'bytes/user':>11} "
+          f"{'file size':>10}")
+    for name, reads, per_user, total in results:
+        print(f"{name:<20} {reads:>12.1f} {per_user:>11.1f} {total:>10}")
+
+
+if __name__ == "__main__":
+    sizes = [int(n) for n in sys.argv[1:]] or [1000, 10000, 100000]
+    with tempfile.TemporaryDirectory() as tmpdir:
+        for numusers in sizes:
+            bench(numusers, tmpdir)
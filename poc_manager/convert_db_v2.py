@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Convert a door controller DB from schema v1 (hashes as hexadecimal
+   TEXT) to schema v2 (hashes as 32-byte BLOBs, WITHOUT ROWID tables).
+   Check door_controller/CODE_OVERVIEW.md for details.
+
+   Usage: convert_db_v2.py input.db output.db"""
+
+import sqlite3, sys, os
+
+SCHEMA_V2 = [
+    "create table users (ID blob primary key, name text) without rowid",
+    "create table doors (ID integer primary key, location text)",
+]
+
+AUTH_V2 = ("create table auth (userID blob not null, {0} integer not null, "
+           "primary key (userID, {0}), "
+           "foreign key (userID) references users(ID){1}) without rowid")
+DOOR_FK = ", foreign key (doorID) references doors(ID)"
+
+# Only if the original DB has them
+SCHEDULES = ("create table schedules (ID integer not null, "
+             "weekday integer not null, start integer not null, "
+             "end integer not null)")
+
+GROUPS = ("create table groups (ID integer not null, "
+          "doorID integer not null, primary key (ID, doorID), "
+          "foreign key (doorID) references doors(ID)) without rowid")
+
+
+def columns(conn, table):
+    return [row[1] for row in conn.execute(f"pragma table_info({table})")]
+
+
+def convert(infile, outfile):
+    if os.path.exists(outfile):
+        os.remove(outfile)
+
+    src = sqlite3.connect(infile)
+    dst = sqlite3.connect(outfile)
+    for statement in SCHEMA_V2:
+        dst.execute(statement)
+
+    for (userID, name) in src.execute("select ID, name from users"):
+        dst.execute("insert or ignore into users values (?, ?)",
+                    (bytes.fromhex(userID), name))
+
+    if "anybody" in columns(src, "doors"):
+        dst.execute("alter table doors add column anybody integer")
+        dst.executemany("insert into doors values (?, ?, ?)",
+                        src.execute("select ID, location, anybody "
+                                    "from doors"))
+    else:
+        dst.executemany("insert into doors values (?, ?)",
+                        src.execute("select ID, location from doors"))
+
+    # auth may refer to door groups instead of doors
+    target = "groupID" if "groupID" in columns(src, "auth") else "doorID"
+    dst.execute(AUTH_V2.format(target, DOOR_FK if target == "doorID" else ""))
+    if target == "groupID":
+        dst.execute(GROUPS)
+        dst.executemany("insert or ignore into groups values (?, ?)",
+                        src.execute("select ID, doorID from groups"))
+
+    if "schedule" in columns(src, "auth"):
+        dst.execute("alter table auth add column schedule integer")
+        dst.execute(SCHEDULES)
+        dst.executemany("insert into schedules values (?, ?, ?, ?)",
+                        src.execute("select ID, weekday, start, end "
+                                    "from schedules"))
+        # v2 allows one row per user and door: keep the least restrictive
+        rows = src.execute(f"select userID, {target}, schedule from auth "
+                           "order by coalesce(schedule, 0)")
+    else:
+        rows = src.execute(f"select userID, {target}, NULL from auth")
+
+    for (userID, target_id, schedule) in rows:
+        if schedule is None:
+            dst.execute(f"insert or ignore into auth (userID, {target}) "
+                        "values (?, ?)", (bytes.fromhex(userID), target_id))
+        else:
+            dst.execute("insert or ignore into auth values (?, ?, ?)",
+                        (bytes.fromhex(userID), target_id, schedule))
+
+    dst.commit()
+    dst.execute("vacuum")
+    dst.close()
+    src.close()
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    convert(sys.argv[1], sys.argv[2])
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Benchmark SQLite page and cache sizes for the door controller DB.
+
+   For each number of users and page size, we generate a synthetic DB
+   (schema v2) and, for each page cache size, run the same query the
+   Authorizer uses (check AuthDB::buildQueries() in
+   door_controller/src/authorizer.cpp) on a random mix of authorized and
+   unknown hashes, starting with an empty cache. We report the p50/p99
+   latency, the pages read from disk per lookup and the peak memory used
+   by SQLite. We call the SQLite C library directly (with ctypes) to get
+   the page and memory counters, so latencies include some Python
+   overhead and only make sense compared to each other; pages read and
+   memory are the same on the door controller for the same page size.
+
+   The door controller runs the same benchmark on its current DB with the
+   MQTT command "benchCache" (check Authorizer::benchmarkCache()).
+
+   Usage: dbbench.py [--users N,...] [--page-sizes N,...]
+                     [--cache-kb N,...] [--hits PERCENT,...]"""
+
+import argparse, ctypes, ctypes.util, os, random, shutil, sqlite3
+import tempfile, time
+
+import authindex
+from authindex_bench import DOOR, create_db
+
+LOOKUPS = 2000
+
+SQLITE_OPEN_READONLY = 0x00000001
+SQLITE_ROW = 100
+SQLITE_STATUS_MEMORY_USED = 0
+SQLITE_DBSTATUS_CACHE_MISS = 8
+SQLITE_TRANSIENT = ctypes.c_void_p(-1)
+
+LOOKUP_QUERY = ("SELECT EXISTS(SELECT * FROM auth "
+                f"WHERE userID=? AND doorID={DOOR})").encode()
+
+lib = ctypes.CDLL(ctypes.util.find_library("sqlite3"))
+lib.sqlite3_bind_blob.argtypes = [ctypes.c_void_p, ctypes.c_int,
+                                  ctypes.c_char_p, ctypes.c_int,
+                                  ctypes.c_void_p]
+for name in ("sqlite3_step", "sqlite3_reset", "sqlite3_finalize",
+             "sqlite3_close_v2"):
+    getattr(lib, name).argtypes = [ctypes.c_void_p]
+lib.sqlite3_exec.argtypes = [ctypes.c_void_p, ctypes.c_char_p,
+                             ctypes.c_void_p, ctypes.c_void_p,
+                             ctypes.c_void_p]
+lib.sqlite3_prepare_v2.argtypes = [ctypes.c_void_p, ctypes.c_char_p,
+                                   ctypes.c_int, ctypes.c_void_p,
+                                   ctypes.c_void_p]
+lib.sqlite3_db_status.argtypes = [ctypes.c_void_p, ctypes.c_int,
+                                  ctypes.c_void_p, ctypes.c_void_p,
+                                  ctypes.c_int]
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, len(values) * p // 100)]
+
+
+def lookups(dbfile, keys, cache_kb):
+    """(sorted latencies in microseconds, pages read, peak SQLite memory)"""
+    current, peak = ctypes.c_int64(), ctypes.c_int64()
+    lib.sqlite3_status64(SQLITE_STATUS_MEMORY_USED, ctypes.byref(current),
+                         ctypes.byref(peak), 1)
+
+    db, stmt = ctypes.c_void_p(), ctypes.c_void_p()
+    if lib.sqlite3_open_v2(dbfile.encode(), ctypes.byref(db),
+                           SQLITE_OPEN_READONLY, None):
+        raise RuntimeError(f"cannot open {dbfile}")
+    lib.sqlite3_exec(db, f"pragma cache_size=-{cache_kb}".encode(),
+                     None, None, None)
+    lib.sqlite3_prepare_v2(db, LOOKUP_QUERY, -1, ctypes.byref(stmt), None)
+
+    times = []
+    for key in keys:
+        start = time.perf_counter()
+        lib.sqlite3_bind_blob(stmt, 1, key, len(key), SQLITE_TRANSIENT)
+        while lib.sqlite3_step(stmt) == SQLITE_ROW:
+            pass
+        lib.sqlite3_reset(stmt)
+        times.append((time.perf_counter() - start) * 1e6)
+
+    misses, unused = ctypes.c_int(), ctypes.c_int()
+    lib.sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS,
+                          ctypes.byref(misses), ctypes.byref(unused), 0)
+    lib.sqlite3_status64(SQLITE_STATUS_MEMORY_USED, ctypes.byref(current),
+                         ctypes.byref(peak), 0)
+    lib.sqlite3_finalize(stmt)
+    lib.sqlite3_close_v2(db)
+    return sorted(times), misses.value, peak.value
+
+
+def bench(numusers, args, tmpdir):
+    base = os.path.join(tmpdir, "base.db")
+    create_db(base, numusers, True)
+    hashes = authindex.authorized_hashes(base, DOOR)
+
+    print(f"\n{numusers} users")
+    print(f"{'page':>5} {'cache KB':>8} {'hits %':>6} {'file KB':>8} "
+          f"{'p50 us':>7} {'p99 us':>7} {'pages/lookup':>12} "
+          f"{'peak KB':>8}")
+    for page_size in args.page_sizes:
+        dbfile = os.path.join(tmpdir, f"{page_size}.db")
+        shutil.copyfile(base, dbfile)
+        conn = sqlite3.connect(dbfile)
+        conn.execute(f"pragma page_size={page_size}")
+        conn.execute("vacuum")
+        conn.close()
+        size_kb = os.path.getsize(dbfile) // 1024
+
+        for hits in args.hits:
+            numhits = LOOKUPS * hits // 100
+            keys = random.choices(hashes, k=numhits) \
+                   + [os.urandom(32) for _ in range(LOOKUPS - numhits)]
+            random.shuffle(keys)
+            for cache_kb in args.cache_kb:
+                times, pages, peak = lookups(dbfile, keys, cache_kb)
+                print(f"{page_size:>5} {cache_kb:>8} {hits:>6} "
+                      f"{size_kb:>8} {percentile(times, 50):>7.1f} "
+                      f"{percentile(times, 99):>7.1f} "
+                      f"{pages / len(keys):>12.2f} {peak // 1024:>8}")
+        os.remove(dbfile)
+
+
+def numbers(text):
+    return [int(n) for n in text.split(",")]
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--users", type=numbers,
+                        default=[1000, 10000, 50000, 200000])
+    parser.add_argument("--page-sizes", type=numbers,
+                        default=[1024, 2048, 4096, 8192])
+    parser.add_argument("--cache-kb", type=numbers, default=[16, 64, 256])
+    parser.add_argument("--hits", type=numbers, default=[10, 50, 90])
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tmpdir:
+        for numusers in args.users:
+            bench(numusers, args, tmpdir)
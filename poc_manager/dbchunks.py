@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Split the door controller DB in chunks for resumable downloads.
+
+   Each chunk is a retained message on its own topic,
+   /topic/dbchunk/<index>, with a header followed by the chunk
+   compressed with zlib (all integers are little-endian, uint32):
+
+     header: "TRAMCHK1", SHA-256 of the whole DB, index, number of
+             chunks, offset, size and CRC32 of the uncompressed chunk
+
+   The door controller appends the chunks to its "other" DB file one at a
+   time and remembers the next chunk it needs, so after a disconnection
+   (or a reboot) it only downloads the chunks it is missing (check
+   door_controller/src/dbmanager.cpp).
+
+   A small retained manifest on /topic/dbmanifest ("MANIFEST <version>
+   <SHA-256 in hexadecimal>") tells the door controllers whether they
+   need to download the DB at all.
+
+   Usage: dbchunks.py file.db outdir"""
+
+import hashlib, os, struct, sys, zlib
+
+CHUNK_MAGIC = b"TRAMCHK1"
+
+# Header of the full DB (/topic/database), for older door controllers
+DB_DIGEST_MAGIC = b"TRAMDB01"
+
+# The door controllers inflate with a buffer of 2^WINDOW_BITS bytes,
+# so we cannot use a larger window
+WINDOW_BITS = 12
+
+# Uncompressed; the smaller the chunks, the less we download again after
+# a disconnection, but each one is a retained message in the broker
+CHUNK_SIZE = 65536
+
+
+def compress(data):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, WINDOW_BITS)
+    return compressor.compress(data) + compressor.flush()
+
+
+def full_db(dbfile):
+    """The message the door controllers expect on /topic/database"""
+    with open(dbfile, "rb") as f:
+        db = f.read()
+    return DB_DIGEST_MAGIC + hashlib.sha256(db).digest() + compress(db)
+
+
+def manifest(dbfile, version):
+    """The message the door controllers expect on /topic/dbmanifest"""
+    with open(dbfile, "rb") as f:
+        digest = hashlib.sha256(f.read()).hexdigest()
+    return f"MANIFEST {version} {digest}\n"
+
+
+def chunks(dbfile, prefix=""):
+    """(topic, message) for each chunk of the DB; "prefix" goes between
+       "/topic/" and "dbchunk" (for the per-door DBs, check dbslice.py)"""
+    with open(dbfile, "rb") as f:
+        db = f.read()
+    digest = hashlib.sha256(db).digest()
+    count = max(1, (len(db) + CHUNK_SIZE - 1) // CHUNK_SIZE)
+    for index in range(count):
+        offset = index * CHUNK_SIZE
+        data = db[offset:offset + CHUNK_SIZE]
+        header = struct.pack("<8s32sIIIII", CHUNK_MAGIC, digest, index,
+                             count, offset, len(data), zlib.crc32(data))
+        yield f"/topic/{prefix}dbchunk/{index}", header + compress(data)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    os.makedirs(sys.argv[2], exist_ok=True)
+    for topic, message in chunks(sys.argv[1]):
+        name = os.path.join(sys.argv[2], topic.rsplit("/", 1)[1] + ".chunk")
+        with open(name, "wb") as f:
+            f.write(message)
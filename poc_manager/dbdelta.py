@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Generate the "delta" between two versions of the door controller DB,
+   i.e., the SQL statements that transform the old DB into the new one.
+   The door controller applies it to its current DB in a single
+   transaction, together with the new DB version ("PRAGMA user_version";
+   check door_controller/src/dbmanager.cpp for the message format).
+
+   Usage: dbdelta.py old.db new.db"""
+
+import collections, sqlite3, sys
+
+# Same as DB_DELTA_MAX_SIZE in the door controller; if the delta is
+# larger than this, the controllers should download the full DB instead
+MAX_DELTA_SIZE = 16384
+
+
+def schema(conn):
+    return sorted(conn.execute("select type, name, sql from sqlite_master "
+                               "where name not like 'sqlite_%'"))
+
+
+def literal(value):
+    if value is None:
+        return "NULL"
+    if isinstance(value, bytes):
+        return f"X'{value.hex()}'"
+    if isinstance(value, str):
+        return "'" + value.replace("'", "''") + "'"
+    return repr(value)
+
+
+def rows(conn, table):
+    return collections.Counter(conn.execute(f"select * from {table}"))
+
+
+def make_delta(oldfile, newfile):
+    """The SQL statements, or None if the schema changed"""
+    old = sqlite3.connect(oldfile)
+    new = sqlite3.connect(newfile)
+    if schema(old) != schema(new):
+        return None
+
+    statements = []
+    for (kind, table, sql) in schema(new):
+        if kind != "table":
+            continue
+        columns = [row[1] for row in new.execute(f"pragma table_info({table})")]
+        old_rows = rows(old, table)
+        new_rows = rows(new, table)
+
+        for row in old_rows:
+            if old_rows[row] <= new_rows[row]:
+                continue
+            # Removes all copies of the row, so we add back what is left
+            condition = " and ".join(f"{column} is {literal(value)}"
+                                     for column, value in zip(columns, row))
+            statements.append(f"delete from {table} where {condition};")
+            old_rows[row] = 0
+
+        for row in new_rows:
+            values = ", ".join(literal(value) for value in row)
+            for _ in range(new_rows[row] - old_rows[row]):
+                statements.append(f"insert into {table} values ({values});")
+
+    old.close()
+    new.close()
+    return "\n".join(statements)
+
+
+def message(base, target, sql):
+    """The message the door controllers expect on /topic/dbdelta"""
+    if sql is None or len(sql) > MAX_DELTA_SIZE:
+        return f"FULL {target}\n"
+    return f"DELTA {base} {target}\n{sql}"
+
+
+def apply_delta(dbfile, sql, version):
+    """Same as the door controller, so our copy of the DB stays in step
+       with theirs (binary patches depend on that; check dbpatch.py)"""
+    conn = sqlite3.connect(dbfile)
+    conn.executescript(f"begin;\n{sql}\npragma user_version={int(version)};"
+                       "\ncommit;")
+    conn.close()
+
+
+def set_version(dbfile, version):
+    conn = sqlite3.connect(dbfile)
+    conn.execute(f"pragma user_version={int(version)}")
+    conn.commit()
+    conn.close()
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    sql = make_delta(sys.argv[1], sys.argv[2])
+    print("-- schema changed, send the full DB" if sql is None else sql)
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Generate a binary patch that transforms one version of the door
+   controller DB into another. This is for bulk changes, when the SQL
+   delta (check dbdelta.py) would be too large: the door controller
+   builds the new file from its current DB file and the patch, then
+   swaps the files just like after a full download (check
+   door_controller/src/dbmanager.cpp).
+
+   The patch is a header followed by a sequence of operations (all
+   integers are little-endian, uint32):
+
+     header: "TRAMDIF1", base version, target version, target size,
+             CRC32 of the target file
+     COPY:   "C", offset, length -- copy bytes from the current file
+     ADD:    "A", length, data   -- append these bytes
+
+   SQLite changes whole pages, so we compare the files page by page: a
+   page of the new file that exists anywhere in the old file becomes a
+   COPY. A changed page is compared, in small blocks, with the page that
+   was at the same offset, so only the blocks that differ become ADDs.
+
+   Usage: dbpatch.py old.db new.db base target output.patch"""
+
+import os, struct, sys, zlib
+
+PATCH_MAGIC = b"TRAMDIF1"
+
+# Changed pages are compared with the old page in blocks of this size
+BLOCK_SIZE = 64
+
+# If the patch is not much smaller than the DB, just send the full DB
+MAX_PATCH_RATIO = 0.5
+
+
+def page_size(data):
+    """SQLite stores the page size at offset 16 (1 means 65536)"""
+    size = struct.unpack_from(">H", data, 16)[0]
+    return 65536 if size == 1 else size
+
+
+def make_patch(oldfile, newfile, base, target):
+    with open(oldfile, "rb") as f:
+        old = f.read()
+    with open(newfile, "rb") as f:
+        new = f.read()
+
+    size = page_size(new)
+    pages = {}
+    for offset in range(0, len(old) - size + 1, size):
+        pages.setdefault(old[offset:offset + size], offset)
+
+    ops = [] # [kind, offset or data, length]
+
+    def copy(source, length):
+        if ops and ops[-1][0] == b"C" and ops[-1][1] + ops[-1][2] == source:
+            ops[-1][2] += length
+        else:
+            ops.append([b"C", source, length])
+
+    def add(data):
+        if ops and ops[-1][0] == b"A":
+            ops[-1][1] += data
+        else:
+            ops.append([b"A", data])
+
+    for offset in range(0, len(new), size):
+        page = new[offset:offset + size]
+        source = pages.get(page)
+        if source is not None:
+            copy(source, len(page))
+            continue
+
+        # A changed page usually keeps most of its cells where they were
+        for block in range(offset, offset + len(page), BLOCK_SIZE):
+            data = new[block:block + BLOCK_SIZE]
+            if old[block:block + BLOCK_SIZE] == data:
+                copy(block, len(data))
+            else:
+                add(data)
+
+    patch = [struct.pack("<8sIIII", PATCH_MAGIC, base, target, len(new),
+                         zlib.crc32(new))]
+    for op in ops:
+        if op[0] == b"C":
+            patch.append(struct.pack("<cII", b"C", op[1], op[2]))
+        else:
+            patch.append(struct.pack("<cI", b"A", len(op[1])) + op[1])
+
+    return b"".join(patch)
+
+
+def worthwhile(patch, newfile):
+    return len(patch) <= MAX_PATCH_RATIO * os.path.getsize(newfile)
+
+
+def apply_patch(oldfile, patch):
+    """Same as the door controller, to check the patch"""
+    with open(oldfile, "rb") as f:
+        old = f.read()
+
+    magic, base, target, size, crc = struct.unpack_from("<8sIIII", patch)
+    pos = struct.calcsize("<8sIIII")
+    new = bytearray()
+    while pos < len(patch):
+        kind = patch[pos:pos + 1]
+        if kind == b"C":
+            offset, length = struct.unpack_from("<II", patch, pos + 1)
+            new += old[offset:offset + length]
+            pos += 9
+        else:
+            length = struct.unpack_from("<I", patch, pos + 1)[0]
+            new += patch[pos + 5:pos + 5 + length]
+            pos += 5 + length
+
+    if len(new) != size or zlib.crc32(new) != crc:
+        raise ValueError("patch does not match")
+    return bytes(new)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 6:
+        print(__doc__)
+        sys.exit(1)
+    patch = make_patch(sys.argv[1], sys.argv[2], int(sys.argv[3]),
+                       int(sys.argv[4]))
+    with open(sys.argv[5], "wb") as f:
+        f.write(patch)
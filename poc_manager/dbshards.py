@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Split the door controller DB in shards by the first byte of the hash.
+
+   With DB_SHARDS > 1 (check door_controller/include/authorizer.h), the
+   door controllers keep one DB file per shard and only open the shard
+   of the card being read. Shard k is a complete DB with all the tables
+   (doors, groups, schedules...), but "users" and "auth" only have the
+   rows of the users whose hash h has h[0] * shards // 256 == k.
+
+   Each shard is a retained message on /topic/dbshard/<k>, in the same
+   format as the full DB (check dbchunks.full_db()), and a retained
+   manifest on /topic/dbshardmanifest has the version of the full DB
+   ("PRAGMA user_version", so the door controllers know which flat index
+   matches their shards) and the SHA-256 of each shard (integers are
+   little-endian, uint32):
+
+     "TRAMSHM2", number of shards, version, SHA-256 of shard 0, of 1...
+
+   The door controllers download the shards whose digest changed, so a
+   change to a few users only sends a few shards. For this to work, a
+   shard that did not change must be identical, byte by byte, to the
+   previous one: we build each one from scratch, inserting the rows in a
+   fixed order, and we do not copy "PRAGMA user_version" (it changes
+   with every DB we publish).
+
+   Usage: dbshards.py file.db shards outdir"""
+
+import hashlib, os, sqlite3, struct, sys
+
+import authindex
+
+SHARD_MANIFEST_MAGIC = b"TRAMSHM2"
+
+# Only these tables are split; the others are copied to every shard
+SHARDED_COLUMNS = {"users": "ID", "auth": "userID"}
+
+
+def shard_of(key, shards):
+    """Hashes we cannot parse go to shard 0; they never match anyway"""
+    binary = authindex.key_to_bytes(key)
+    return binary[0] * shards // 256 if binary else 0
+
+
+def build_shard(dbfile, shards, shard, outfile):
+    if os.path.exists(outfile):
+        os.remove(outfile)
+
+    src = sqlite3.connect(dbfile)
+    src.create_function("shard_of", 1, lambda key: shard_of(key, shards),
+                        deterministic=True)
+    dst = sqlite3.connect(outfile)
+    page_size = src.execute("pragma page_size").fetchone()[0]
+    dst.execute(f"pragma page_size={page_size}")
+
+    schema = src.execute("select type, name, sql from sqlite_master "
+                         "where sql is not null and name not like 'sqlite_%' "
+                         "order by type = 'table' desc, name").fetchall()
+
+    for (kind, name, sql) in schema:
+        dst.execute(sql)
+        if kind != "table":
+            continue
+        ncols = len(authindex.columns(src, name))
+        order = ", ".join(str(i + 1) for i in range(ncols))
+        where = ""
+        if name in SHARDED_COLUMNS:
+            where = f"where shard_of({SHARDED_COLUMNS[name]}) = {shard}"
+        rows = src.execute(f"select * from {name} {where} order by {order}")
+        params = ", ".join("?" * ncols)
+        dst.executemany(f"insert into {name} values ({params})", rows)
+
+    dst.commit()
+    dst.execute("vacuum")
+    dst.close()
+    src.close()
+
+
+def build_shards(dbfile, shards, outdir):
+    """The filename of each shard, in outdir"""
+    os.makedirs(outdir, exist_ok=True)
+    files = []
+    for shard in range(shards):
+        outfile = os.path.join(outdir, f"shard{shard}.db")
+        build_shard(dbfile, shards, shard, outfile)
+        files.append(outfile)
+    return files
+
+
+def digest(filename):
+    with open(filename, "rb") as f:
+        return hashlib.sha256(f.read()).digest()
+
+
+def manifest(files, version):
+    """The message the door controllers expect on /topic/dbshardmanifest"""
+    return (SHARD_MANIFEST_MAGIC + struct.pack("<II", len(files), version)
+            + b"".join(digest(f) for f in files))
+
+
+def changed_shards(files, previous):
+    """Indexes of the shards whose digest is not the one in "previous"
+       (an older manifest, or None)"""
+    offset = len(SHARD_MANIFEST_MAGIC) + 8
+    if (previous is None or not previous.startswith(SHARD_MANIFEST_MAGIC)
+            or len(previous) != offset + 32 * len(files)):
+        return list(range(len(files)))
+
+    old = [previous[offset + 32 * i:offset + 32 * (i + 1)]
+           for i in range(len(files))]
+    return [i for i, f in enumerate(files) if digest(f) != old[i]]
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        print(__doc__)
+        sys.exit(1)
+    files = build_shards(sys.argv[1], int(sys.argv[2]), sys.argv[3])
+    with open(os.path.join(sys.argv[3], "manifest"), "wb") as f:
+        f.write(manifest(files, authindex.db_version(sys.argv[1])))
+    for name in files:
+        print(f"{name}: {os.path.getsize(name)} bytes")
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Generate the slice of the door controller DB for a single door.
+
+   A door controller built with DB_PER_DOOR (check
+   door_controller/src/mqttmanager.cpp) downloads only its slice, on
+   /topic/door/<doorID>/..., instead of the whole DB. The slice has the
+   same schema as the DB, so the door controller queries it just the
+   same, but only with the rows this door needs:
+
+     doors     only this door
+     groups    only the groups of this door
+     auth      only the authorizations for this door (or its groups);
+               none if the door is open to anybody
+     users     only the users in "auth" (all of them if the door is open
+               to anybody), without names or any other column but "ID"
+     schedules only the schedules used in "auth"
+
+   Other tables are copied as they are. The slice is VACUUMed with the
+   page size (up to the page size the door controller is built for) that
+   needs the fewest pages per lookup and, among those, makes the smallest
+   file. Rows are inserted in a fixed order, so the same data always
+   generates the same file.
+
+   Usage: dbslice.py file.db doorID output.db"""
+
+import os, shutil, sqlite3, sys, tempfile
+
+import authindex
+
+# SQLITE_PAGE_SIZE in door_controller/include/sqlitemem.h; larger pages
+# do not fit in the page cache pool
+MAX_PAGE_SIZE = 4096
+PAGE_SIZES = [size for size in (1024, 2048, 4096) if size <= MAX_PAGE_SIZE]
+
+
+def has_table(conn, table):
+    return conn.execute("select count(*) from sqlite_master where type = "
+                        "'table' and name = ?", (table,)).fetchone()[0] > 0
+
+
+def row_filters(conn, door):
+    """{table: (columns to copy, where clause)}; other tables are copied
+       as they are. Same logic as Authorizer::buildQueries() in the door
+       controller (check authindex.users_query())."""
+    anybody = authindex.users_query(conn, door)[0] == "select ID from users"
+    auth_columns = authindex.columns(conn, "auth")
+
+    if "groupID" in auth_columns:
+        door_auth = f"groupID in (select ID from groups where doorID={door})"
+    else:
+        door_auth = f"doorID={door}"
+
+    users = authindex.columns(conn, "users")
+    filters = {
+        "doors": (None, f"ID={door}"),
+        "auth": (None, "0" if anybody else door_auth),
+        "users": (["ID"] + ["NULL"] * (len(users) - 1),
+                  None if anybody else
+                  f"ID in (select userID from auth where {door_auth})"),
+    }
+    if has_table(conn, "groups"):
+        filters["groups"] = (None, f"doorID={door}")
+    if has_table(conn, "schedules") and "schedule" in auth_columns:
+        filters["schedules"] = (None, "0" if anybody else
+                                "ID in (select schedule from auth "
+                                f"where {door_auth})")
+    return filters
+
+
+def build_slice(dbfile, door, outfile, page_size):
+    if os.path.exists(outfile):
+        os.remove(outfile)
+
+    src = sqlite3.connect(dbfile)
+    dst = sqlite3.connect(outfile)
+    dst.execute(f"pragma page_size={page_size}")
+
+    filters = row_filters(src, int(door))
+    schema = src.execute("select type, name, sql from sqlite_master "
+                         "where sql is not null and name not like 'sqlite_%' "
+                         "order by type = 'table' desc, name").fetchall()
+
+    for (kind, name, sql) in schema:
+        dst.execute(sql)
+        if kind != "table":
+            continue
+        ncols = len(authindex.columns(src, name))
+        copied, where = filters.get(name, (None, None))
+        select = ", ".join(copied) if copied else "*"
+        where = f"where {where}" if where else ""
+        order = ", ".join(str(i + 1) for i in range(ncols))
+        rows = src.execute(f"select {select} from {name} {where} "
+                           f"order by {order}")
+        params = ", ".join("?" * ncols)
+        dst.executemany(f"insert into {name} values ({params})", rows)
+
+    dst.commit()
+    dst.execute("vacuum")
+    dst.close()
+    src.close()
+
+
+def lookup_depth(dbfile, door):
+    """Pages read per lookup: the depth of the deepest B-tree of the
+       table the door controller queries (0 if SQLite has no dbstat)"""
+    conn = sqlite3.connect(dbfile)
+    query = authindex.users_query(conn, door)[0]
+    table = "users" if query == "select ID from users" else "auth"
+    try:
+        rows = conn.execute("select path from dbstat where name = ? or name "
+                            "in (select name from sqlite_master where "
+                            "tbl_name = ?)", (table, table)).fetchall()
+    except sqlite3.OperationalError:
+        rows = []
+    conn.close()
+    return max((path.count("/") for (path,) in rows), default=0)
+
+
+def make_slice(dbfile, door, outfile):
+    """Build the slice with the best page size; returns the page size"""
+    best = None
+    tmpdir = tempfile.mkdtemp()
+    try:
+        for page_size in PAGE_SIZES:
+            candidate = os.path.join(tmpdir, f"{page_size}.db")
+            build_slice(dbfile, door, candidate, page_size)
+            cost = (lookup_depth(candidate, door),
+                    os.path.getsize(candidate))
+            if best is None or cost < best[0]:
+                best = (cost, page_size, candidate)
+        shutil.copyfile(best[2], outfile)
+    finally:
+        shutil.rmtree(tmpdir)
+    return best[1]
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        print(__doc__)
+        sys.exit(1)
+    page_size = make_slice(sys.argv[1], int(sys.argv[2]), sys.argv[3])
+    print(f"{sys.argv[3]}: {os.path.getsize(sys.argv[3])} bytes, "
+          f"page size {page_size}")
@@ -16,7 +16,9 @@
       an sqlite DB according to its type (access or system)"""
 # ---------------------------------------------------------------------------
 
-import ssl, sys, time, logging, sqlite3, inspect, os, random, time
+import ssl, sys, time, logging, sqlite3, inspect, os, random, time, shutil
+
+import authindex, dbchunks, dbdelta, dbpatch, dbshards, dbslice
 
 #BROKER_ADDRESS = '10.0.2.109'
 BROKER_PORT = 8883
@@ -34,6 +36,19 @@ FM_PATTERNS = ["*.bin"]
 
 
 DB_NAME = "messages.db"
+
+# Copy of the last DB we published, so we can generate deltas
+PUBLISHED_DB = "published.db"
+
+# Copies of the last slice of the DB we published for each door (check
+# dbslice.py), for door controllers built with DB_PER_DOOR
+PUBLISH_DOOR_SLICES = True
+SLICES_DIR = "slices"
+
+# Must match DB_SHARDS in the door controllers (check dbshards.py); with
+# 1, we do not publish shards at all
+DB_SHARDS = 1
+SHARDS_DIR = "shards"
 TABLES = {
     "access": "bootcount INT, \
                 time VARCHAR(40),\
@@ -93,7 +108,7 @@ class OurMQTT():
             with open(filename, mode="rb") as f:
                 if topic == "database":
                     result = self.client.publish(f"/topic/{topic}",
-                                                f.read(),
+                                                dbchunks.full_db(filename),
                                                 retain=True, qos=2)
                 else:
                     result = self.client.publish(f"/topic/{topic}",
@@ -108,6 +123,82 @@ class OurMQTT():
         time.sleep(1)
 
 
+    def publish_flat_indexes(self, filename):
+        """Publish the flat index for each door listed in the DB"""
+        try:
+            for door in authindex.doors(filename):
+                index = authindex.build_index(filename, door)
+                print(f"publishing flat index for door {door} "
+                      f"({len(index)} bytes)")
+                result = self.client.publish(f"/topic/authindex/{door}",
+                                             index, retain=True, qos=2)
+                if result[0] != 0:
+                    print("Publish failed!\n")
+        except sqlite3.Error as e:
+            print(f"Cannot generate flat indexes from {filename}: {e}")
+
+
+    def publish_chunks(self, filename, prefix=""):
+        """Publish the DB in chunks, for resumable downloads. If the new
+           DB has fewer chunks, the extra ones are left behind; their
+           digest does not match, so the door controllers start over if
+           they get one."""
+        count = 0
+        for topic, message in dbchunks.chunks(filename, prefix):
+            result = self.client.publish(topic, message, retain=True, qos=2)
+            if result[0] != 0:
+                print("Publish failed!\n")
+            count += 1
+        print(f"published {filename} in {count} chunks")
+
+
+    def publish_manifest(self, filename, prefix=""):
+        message = dbchunks.manifest(filename, authindex.db_version(filename))
+        print(f"publishing DB manifest: {message.strip()}")
+        result = self.client.publish(f"/topic/{prefix}dbmanifest", message,
+                                     retain=True, qos=2)
+        if result[0] != 0:
+            print("Publish failed!\n")
+
+
+    def publish_shards(self, filename):
+        """Publish the shards that changed since the last manifest we
+           published, then the new manifest"""
+        files = dbshards.build_shards(filename, DB_SHARDS, SHARDS_DIR)
+        manifest_file = os.path.join(SHARDS_DIR, "manifest")
+        previous = None
+        if os.path.exists(manifest_file):
+            with open(manifest_file, "rb") as f:
+                previous = f.read()
+
+        for shard in dbshards.changed_shards(files, previous):
+            print(f"publishing DB shard {shard}")
+            result = self.client.publish(f"/topic/dbshard/{shard}",
+                                         dbchunks.full_db(files[shard]),
+                                         retain=True, qos=2)
+            if result[0] != 0:
+                print("Publish failed!\n")
+
+        message = dbshards.manifest(files, authindex.db_version(filename))
+        result = self.client.publish("/topic/dbshardmanifest", message,
+                                     retain=True, qos=2)
+        if result[0] != 0:
+            print("Publish failed!\n")
+        with open(manifest_file, "wb") as f:
+            f.write(message)
+
+
+    def publish_delta(self, message, prefix=""):
+        if isinstance(message, bytes):
+            print(f"publishing DB patch ({len(message)} bytes)")
+        else:
+            print(f"publishing DB delta: {message.splitlines()[0]}")
+        result = self.client.publish(f"/topic/{prefix}dbdelta", message,
+                                     retain=True, qos=2)
+        if result[0] != 0:
+            print("Publish failed!\n")
+
+
     def subscribe(self, topic):
         print(f"subscribing to topic {topic}")
         self.client.subscribe(f"/topic/{topic}", 1)
@@ -277,10 +368,89 @@ class Main():
             theMain.sendFM(filename)
 
         self.mqtt = OurMQTT()
+        # The door controllers only download the DB if it does
+        # not match the manifest, so make sure there is one
+        if os.path.exists(PUBLISHED_DB):
+            self.mqtt.publish_manifest(PUBLISHED_DB)
+        if PUBLISH_DOOR_SLICES and os.path.isdir(SLICES_DIR):
+            for door, published in door_slices():
+                self.mqtt.publish_manifest(published, f"door/{door}/")
         self.diskMonitor = DiskMonitor(cmdHandler, dbUploadHandler, fmUploadHandler)
     
+    # Each DB we publish gets a new version number ("PRAGMA user_version").
+    # Controllers that are already running only receive the delta from
+    # the previous version (SQL statements or, for bulk changes, a binary
+    # patch); the full DB (retained) is for those that miss some delta
+    # or boot with an outdated DB (according to the manifest).
+    #
+    # A binary patch refers to the bytes of the previous file, so
+    # PUBLISHED_DB should be byte-by-byte identical to what the controllers
+    # have. That is why, when we send SQL statements, we apply them to our
+    # copy instead of just using the uploaded file.
     def sendDB(self, filename):
-        self.mqtt.publish("database", filename)
+        base = 0
+        if os.path.exists(PUBLISHED_DB):
+            base = authindex.db_version(PUBLISHED_DB)
+
+        newfile = PUBLISHED_DB + ".new"
+        shutil.copyfile(filename, newfile)
+        dbdelta.set_version(newfile, base + 1)
+
+        sql = dbdelta.make_delta(PUBLISHED_DB, newfile) if base > 0 else None
+        if sql == "":
+            print(f"{filename} did not change, not publishing it")
+            os.remove(newfile)
+            return
+
+        message = make_update(PUBLISHED_DB, newfile, base, base + 1, sql)
+        os.replace(newfile, PUBLISHED_DB)
+        self.mqtt.publish_chunks(PUBLISHED_DB)
+        self.mqtt.publish_manifest(PUBLISHED_DB)
+        self.mqtt.publish("database", PUBLISHED_DB) # older door controllers
+        self.mqtt.publish_flat_indexes(PUBLISHED_DB)
+        self.mqtt.publish_delta(message)
+        if PUBLISH_DOOR_SLICES:
+            self.sendDoorSlices(base + 1)
+        if DB_SHARDS > 1:
+            self.mqtt.publish_shards(PUBLISHED_DB)
+
+    # Each slice goes through the same steps as the full DB, with the same
+    # version (so the flat index of the door matches it), on the topics of
+    # the door ("/topic/door/<doorID>/dbdelta" etc.). Most changes only
+    # affect some doors; if the slice of a door did not change, we keep
+    # the file, its chunks and its manifest as they are (at the version
+    # they had) and only send an empty delta, which the door controllers
+    # take as a new version of the DB they have, without touching it
+    # (check UpdateDBManager::bumpVersion() in dbmanager.cpp).
+    def sendDoorSlices(self, version):
+        os.makedirs(SLICES_DIR, exist_ok=True)
+        for door in authindex.doors(PUBLISHED_DB):
+            published = os.path.join(SLICES_DIR, f"{door}.db")
+            base = 0
+            if os.path.exists(published):
+                base = authindex.db_version(published)
+
+            newfile = published + ".new"
+            page_size = dbslice.make_slice(PUBLISHED_DB, door, newfile)
+            dbdelta.set_version(newfile, version)
+            print(f"DB slice for door {door}: "
+                  f"{os.path.getsize(newfile)} bytes, page size {page_size}")
+
+            prefix = f"door/{door}/"
+            sql = dbdelta.make_delta(published, newfile) if base > 0 else None
+            if sql == "":
+                print(f"DB slice for door {door} did not change")
+                os.remove(newfile)
+                self.mqtt.publish_delta(dbdelta.message(base, version, ""),
+                                        prefix)
+                continue
+
+            message = make_update(published, newfile, base, version, sql)
+            os.replace(newfile, published)
+
+            self.mqtt.publish_chunks(published, prefix)
+            self.mqtt.publish_manifest(published, prefix)
+            self.mqtt.publish_delta(message, prefix)
 
     def sendCommand(self, filename):
         self.mqtt.publish("commands", filename)
@@ -293,6 +463,31 @@ class Main():
         self.mqtt.stop()
 
 
+def make_update(published, newfile, base, target, sql):
+    """The delta from "published" (version "base", 0 if there is none) to
+       "newfile" (version "target"), given the SQL statements from
+       dbdelta.make_delta(). Check Main.sendDB() for why, if we send SQL,
+       "newfile" becomes a copy of "published" with the SQL applied."""
+    if sql is not None and len(sql) <= dbdelta.MAX_DELTA_SIZE:
+        message = dbdelta.message(base, target, sql)
+        shutil.copyfile(published, newfile)
+        dbdelta.apply_delta(newfile, sql, target)
+    elif base > 0:
+        message = dbpatch.make_patch(published, newfile, base, target)
+        if not dbpatch.worthwhile(message, newfile):
+            message = dbdelta.message(base, target, None)
+    else:
+        message = dbdelta.message(base, target, None)
+    return message
+
+
+def door_slices():
+    """(doorID, filename) of each slice we published"""
+    for name in sorted(os.listdir(SLICES_DIR)):
+        if name.endswith(".db"):
+            yield int(name[:-3]), os.path.join(SLICES_DIR, name)
+
+
 def main():
     mainObject = Main()
     try: